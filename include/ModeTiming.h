@@ -0,0 +1,77 @@
+/*
+Symbol timing of the digital modes: tone spacings and symbol periods as exact
+fractions, and the nominal symbol period of every OperatingModes entry.
+Shared by the firmware and the host side tests under test/.
+ */
+
+#ifndef _INCLUDE_MODE_TIMING_H_
+#define _INCLUDE_MODE_TIMING_H_
+
+#include <stdint.h>
+
+// Exact fraction num / den, used for tone spacings and symbol periods
+struct Fraction
+{
+  uint32_t num;
+  uint32_t den;
+};
+
+// Tone spacings in Hz
+constexpr Fraction JT9_TONE_SPACING = {12000, 6912};  // ~1.74 Hz
+constexpr Fraction JT65_TONE_SPACING = {11025, 4096}; // ~2.69 Hz
+constexpr Fraction JT4_TONE_SPACING = {11025, 2520};  // 4.375 Hz
+constexpr Fraction WSPR_TONE_SPACING = {12000, 8192}; // ~1.46 Hz
+constexpr Fraction FSQ_TONE_SPACING = {36000, 4096};  // ~8.79 Hz
+constexpr Fraction FT8_TONE_SPACING = {12000, 1920};  // 6.25 Hz
+constexpr Fraction FT4_TONE_SPACING = {12000, 576};   // ~20.83 Hz
+
+// Symbol periods in seconds
+constexpr Fraction JT9_DELAY = {6912, 12000};  // JT9-1
+constexpr Fraction JT65_DELAY = {4096, 11025}; // JT65A
+constexpr Fraction JT4_DELAY = {2520, 11025};  // JT4A
+constexpr Fraction WSPR_DELAY = {8192, 12000}; // WSPR
+constexpr Fraction FSQ_2_DELAY = {1, 2};       // 2 baud FSQ
+constexpr Fraction FSQ_3_DELAY = {1, 3};       // 3 baud FSQ
+constexpr Fraction FSQ_4_5_DELAY = {2, 9};     // 4.5 baud FSQ
+constexpr Fraction FSQ_6_DELAY = {1, 6};       // 6 baud FSQ
+constexpr Fraction FT8_DELAY = {1920, 12000};  // FT8
+constexpr Fraction FT4_DELAY = {576, 12000};   // FT4
+
+enum OperatingModes
+{
+  MODE_CW,
+  MODE_PIXIE_CW,
+  MODE_WSPR,
+  MODE_FT8,
+  MODE_FT4,
+  MODE_FSQ_2,
+  MODE_FSQ_3,
+  MODE_FSQ_4_5,
+  MODE_FSQ_6,
+  MODE_JT9,
+  MODE_JT65,
+  MODE_JT4,
+  MODE_RAW,
+};
+
+const uint8_t MODE_COUNT = MODE_RAW + 1;
+
+// Symbol period of every mode in s, indexed by OperatingModes.
+// CW is at the default keyer speed and follows the keyer instead, PIXIE_CW and RAW have no period of their own
+constexpr Fraction modePeriods[MODE_COUNT] = {
+    {6, 75},        // MODE_CW
+    {1, 1},         // MODE_PIXIE_CW
+    WSPR_DELAY,     // MODE_WSPR
+    FT8_DELAY,      // MODE_FT8
+    FT4_DELAY,      // MODE_FT4
+    FSQ_2_DELAY,    // MODE_FSQ_2
+    FSQ_3_DELAY,    // MODE_FSQ_3
+    FSQ_4_5_DELAY,  // MODE_FSQ_4_5
+    FSQ_6_DELAY,    // MODE_FSQ_6
+    JT9_DELAY,      // MODE_JT9
+    JT65_DELAY,     // MODE_JT65
+    JT4_DELAY,      // MODE_JT4
+    {1, 1},         // MODE_RAW
+};
+
+#endif // _INCLUDE_MODE_TIMING_H_
@@ -24,3 +24,45 @@ void FT8::encode(char *message, uint8_t *tones, bool isFT4)
         ft8_encode(packed, tones);
     }
 }
+
+void FT8::encodeBegin(FT8Job *job, char *message, uint8_t *tones, bool isFT4)
+{
+    // message and tones must stay valid until encodeStep() returns true
+    job->message = message;
+    job->tones = tones;
+    job->isFT4 = isFT4;
+    job->packed = false;
+}
+
+bool FT8::encodeStep(FT8Job *job, int maxRows)
+{
+    // Packing the text is a step of its own, then the tones are computed in slices
+    if (!job->packed)
+    {
+        uint8_t packed[FTX_LDPC_K_BYTES];
+        pack77(job->message, packed);
+        ftx_encode_begin(&job->encode, packed, job->tones, job->isFT4);
+        job->packed = true;
+        return false;
+    }
+    return ftx_encode_step(&job->encode, maxRows);
+}
+
+// 0..100, the packing step is counted as part of the first percent
+int FT8::encodeProgress(const FT8Job *job)
+{
+    return job->packed ? ftx_encode_progress(&job->encode) : 0;
+}
+
+ftx_verify_t FT8::verify(char *message, const uint8_t *tones, bool isFT4)
+{
+    // Pack the text again and check that the tones carry exactly that payload
+    uint8_t packed[FTX_LDPC_K_BYTES];
+    pack77(message, packed);
+
+    if (isFT4)
+    {
+        return ft4_verify(tones, packed);
+    }
+    return ft8_verify(tones, packed);
+}
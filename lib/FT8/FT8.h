@@ -8,12 +8,28 @@ From this commit: https://github.com/kgoba/ft8_lib/commit/cd0dc2eca3c14526d6d96a
 #define FT8_H_
 
 #include "Arduino.h"
+#include "verify.h"
+#include "encode.h"
+
+/// A text message encode spread over several FT8::encodeStep() calls
+struct FT8Job
+{
+    char *message;
+    uint8_t *tones;
+    bool isFT4;
+    bool packed;
+    ftx_encode_job_t encode;
+};
 
 class FT8
 {
 public:
     FT8();
     void encode(char *message, uint8_t *tones, bool is_ft4);
+    void encodeBegin(FT8Job *job, char *message, uint8_t *tones, bool is_ft4);
+    bool encodeStep(FT8Job *job, int maxRows);
+    int encodeProgress(const FT8Job *job);
+    ftx_verify_t verify(char *message, const uint8_t *tones, bool is_ft4);
 };
 
 #endif // FT8_H_
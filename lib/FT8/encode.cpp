@@ -11,66 +11,38 @@ static uint8_t parity8(uint8_t x)
     return x % 2; // modulo 2
 }
 
-// Encode via LDPC a 91-bit message and return a 174-bit codeword.
-// The generator matrix has dimensions (87,87).
+// Compute one LDPC checksum bit of the (174,91) code and store it in codeword.
+// The generator matrix has dimensions (83,91), row i yields codeword bit FTX_LDPC_K + i.
 // The code is a (174,91) regular LDPC code with column weight 3.
 // Arguments:
 // [IN] message   - array of 91 bits stored as 12 bytes (MSB first)
-// [OUT] codeword - array of 174 bits stored as 22 bytes (MSB first)
-static void encode174(const uint8_t *message, uint8_t *codeword)
+// [OUT] codeword - array of 174 bits stored as 22 bytes (MSB first), checksum bits cleared beforehand
+// [IN] i         - generator row, 0..FTX_LDPC_M-1
+static void encode174_row(const uint8_t *message, uint8_t *codeword, int i)
 {
     // This implementation accesses the generator bits straight from the packed binary representation in kFTX_LDPC_generator
 
-    // Fill the codeword with message and zeros, as we will only update binary ones later
-    for (int j = 0; j < FTX_LDPC_N_BYTES; ++j)
+    // Fast implementation of bitwise multiplication and parity checking
+    // Normally nsum would contain the result of dot product between message and kFTX_LDPC_generator[i],
+    // but we only compute the sum modulo 2.
+    uint8_t nsum = 0;
+    for (int j = 0; j < FTX_LDPC_K_BYTES; ++j)
     {
-        codeword[j] = (j < FTX_LDPC_K_BYTES) ? message[j] : 0;
+        uint8_t bits = message[j] & kFTX_LDPC_generator[i][j]; // bitwise AND (bitwise multiplication)
+        nsum ^= parity8(bits);                                 // bitwise XOR (addition modulo 2)
     }
 
-    // Compute the byte index and bit mask for the first checksum bit
-    uint8_t col_mask = (0x80u >> (FTX_LDPC_K % 8u)); // bitmask of current byte
-    uint8_t col_idx = FTX_LDPC_K_BYTES - 1;          // index into byte array
-
-    // Compute the LDPC checksum bits and store them in codeword
-    for (int i = 0; i < FTX_LDPC_M; ++i)
+    // Set the checksum bit in codeword if nsum is odd
+    if (nsum % 2)
     {
-        // Fast implementation of bitwise multiplication and parity checking
-        // Normally nsum would contain the result of dot product between message and kFTX_LDPC_generator[i],
-        // but we only compute the sum modulo 2.
-        uint8_t nsum = 0;
-        for (int j = 0; j < FTX_LDPC_K_BYTES; ++j)
-        {
-            uint8_t bits = message[j] & kFTX_LDPC_generator[i][j]; // bitwise AND (bitwise multiplication)
-            nsum ^= parity8(bits);                                 // bitwise XOR (addition modulo 2)
-        }
-
-        // Set the current checksum bit in codeword if nsum is odd
-        if (nsum % 2)
-        {
-            codeword[col_idx] |= col_mask;
-        }
-
-        // Update the byte index and bit mask for the next checksum bit
-        col_mask >>= 1;
-        if (col_mask == 0)
-        {
-            col_mask = 0x80u;
-            ++col_idx;
-        }
+        int n = FTX_LDPC_K + i;
+        codeword[n / 8] |= (0x80u >> (n % 8));
     }
 }
 
-void ft8_encode(const uint8_t *payload, uint8_t *tones)
+// Map a 174-bit codeword onto the FT8 tone sequence
+static void ft8_tones(const uint8_t *codeword, uint8_t *tones)
 {
-    uint8_t a91[FTX_LDPC_K_BYTES]; // Store 77 bits of payload + 14 bits CRC
-
-    // Compute and add CRC at the end of the message
-    // a91 contains 77 bits of payload + 14 bits of CRC
-    ftx_add_crc(payload, a91);
-
-    uint8_t codeword[FTX_LDPC_N_BYTES];
-    encode174(a91, codeword);
-
     // Message structure: S7 D29 S7 D29 S7
     // Total symbols: 79 (FT8_NN)
 
@@ -122,25 +94,9 @@ void ft8_encode(const uint8_t *payload, uint8_t *tones)
     }
 }
 
-void ft4_encode(const uint8_t *payload, uint8_t *tones)
+// Map a 174-bit codeword onto the FT4 tone sequence
+static void ft4_tones(const uint8_t *codeword, uint8_t *tones)
 {
-    uint8_t a91[FTX_LDPC_K_BYTES]; // Store 77 bits of payload + 14 bits CRC
-    uint8_t payload_xor[10];       // Encoded payload data
-
-    // '[..] for FT4 only, in order to avoid transmitting a long string of zeros when sending CQ messages,
-    // the assembled 77-bit message is bitwise exclusive-OR’ed with [a] pseudorandom sequence before computing the CRC and FEC parity bits'
-    for (int i = 0; i < 10; ++i)
-    {
-        payload_xor[i] = payload[i] ^ kFT4_XOR_sequence[i];
-    }
-
-    // Compute and add CRC at the end of the message
-    // a91 contains 77 bits of payload + 14 bits of CRC
-    ftx_add_crc(payload_xor, a91);
-
-    uint8_t codeword[FTX_LDPC_N_BYTES];
-    encode174(a91, codeword); // 91 bits -> 174 bits
-
     // Message structure: R S4_1 D29 S4_2 D29 S4_3 D29 S4_4 R
     // Total symbols: 105 (FT4_NN)
 
@@ -191,3 +147,94 @@ void ft4_encode(const uint8_t *payload, uint8_t *tones)
         }
     }
 }
+
+void ftx_encode_begin(ftx_encode_job_t *job, const uint8_t *payload, uint8_t *tones, bool is_ft4)
+{
+    job->is_ft4 = is_ft4;
+    job->stage = FTX_ENCODE_CRC;
+    job->row = 0;
+    job->tones = tones;
+
+    // '[..] for FT4 only, in order to avoid transmitting a long string of zeros when sending CQ messages,
+    // the assembled 77-bit message is bitwise exclusive-OR’ed with [a] pseudorandom sequence before computing the CRC and FEC parity bits'
+    for (int i = 0; i < 10; ++i)
+    {
+        job->payload[i] = is_ft4 ? (payload[i] ^ kFT4_XOR_sequence[i]) : payload[i];
+    }
+}
+
+bool ftx_encode_step(ftx_encode_job_t *job, int max_rows)
+{
+    switch (job->stage)
+    {
+    case FTX_ENCODE_CRC:
+        // Compute and add CRC at the end of the message
+        // a91 contains 77 bits of payload + 14 bits of CRC
+        ftx_add_crc(job->payload, job->a91);
+
+        // Fill the codeword with message and zeros, as we will only update binary ones later
+        for (int j = 0; j < FTX_LDPC_N_BYTES; ++j)
+        {
+            job->codeword[j] = (j < FTX_LDPC_K_BYTES) ? job->a91[j] : 0;
+        }
+        job->stage = FTX_ENCODE_PARITY;
+        return false;
+
+    case FTX_ENCODE_PARITY:
+        for (int n = 0; (n < max_rows || max_rows <= 0) && job->row < FTX_LDPC_M; ++n)
+        {
+            encode174_row(job->a91, job->codeword, job->row++);
+        }
+        if (job->row == FTX_LDPC_M)
+            job->stage = FTX_ENCODE_TONES;
+        return false;
+
+    case FTX_ENCODE_TONES:
+        if (job->is_ft4)
+            ft4_tones(job->codeword, job->tones);
+        else
+            ft8_tones(job->codeword, job->tones);
+        job->stage = FTX_ENCODE_DONE;
+        return true;
+
+    case FTX_ENCODE_DONE:
+        break;
+    }
+    return true;
+}
+
+int ftx_encode_progress(const ftx_encode_job_t *job)
+{
+    int units;
+    switch (job->stage)
+    {
+    case FTX_ENCODE_CRC:
+        units = 0;
+        break;
+    case FTX_ENCODE_PARITY:
+        units = 1 + job->row;
+        break;
+    case FTX_ENCODE_TONES:
+        units = 1 + FTX_LDPC_M;
+        break;
+    default:
+        return 100;
+    }
+    return units * 100 / (FTX_LDPC_M + 2);
+}
+
+void ft8_encode(const uint8_t *payload, uint8_t *tones)
+{
+    ftx_encode_job_t job;
+    ftx_encode_begin(&job, payload, tones, false);
+    while (!ftx_encode_step(&job, 0))
+        ;
+}
+
+void ft4_encode(const uint8_t *payload, uint8_t *tones)
+{
+    ftx_encode_job_t job;
+    ftx_encode_begin(&job, payload, tones, true);
+    while (!ftx_encode_step(&job, 0))
+        ;
+}
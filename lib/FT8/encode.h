@@ -2,6 +2,8 @@
 #define _INCLUDE_ENCODE_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "constants.h"
 
 // typedef struct
 // {
@@ -29,4 +31,42 @@ void ft8_encode(const uint8_t *payload, uint8_t *tones);
 /// @param[out] tones  - array of FT4_NN (105) bytes to store the generated tones (encoded as 0..3)
 void ft4_encode(const uint8_t *payload, uint8_t *tones);
 
+typedef enum
+{
+    FTX_ENCODE_CRC,    ///< Next step appends the CRC-14 to the payload
+    FTX_ENCODE_PARITY, ///< Next steps compute the LDPC checksum bits, a few generator rows at a time
+    FTX_ENCODE_TONES,  ///< Next step maps the codeword onto tones
+    FTX_ENCODE_DONE    ///< Tones are complete
+} ftx_encode_stage_t;
+
+/// State of a resumable encode, see ftx_encode_begin() and ftx_encode_step()
+typedef struct
+{
+    bool is_ft4;
+    ftx_encode_stage_t stage;
+    int row;                            ///< Next LDPC generator row to evaluate
+    uint8_t payload[10];                ///< 77 bit payload, already scrambled for FT4
+    uint8_t a91[FTX_LDPC_K_BYTES];      ///< Payload + CRC
+    uint8_t codeword[FTX_LDPC_N_BYTES]; ///< Payload + CRC + LDPC checksum
+    uint8_t *tones;                     ///< Output, FT8_NN or FT4_NN bytes
+} ftx_encode_job_t;
+
+/// Start a resumable FT8/FT4 encode. Nothing is computed until ftx_encode_step() is called.
+/// @param[out] job    - encode state, owned by the caller until the encode is done
+/// @param[in] payload - 10 byte array consisting of 77 bit payload (copied)
+/// @param[out] tones  - array of FT8_NN (79) or FT4_NN (105) bytes, written by the last step
+/// @param[in] is_ft4  - produce FT4 instead of FT8 tones
+void ftx_encode_begin(ftx_encode_job_t *job, const uint8_t *payload, uint8_t *tones, bool is_ft4);
+
+/// Advance a resumable encode by one bounded step: the CRC, up to max_rows LDPC
+/// generator rows (of FTX_LDPC_M), or the tone mapping.
+/// @param[in,out] job  - encode state from ftx_encode_begin()
+/// @param[in] max_rows - LDPC rows per step, 0 or less for all remaining rows
+/// @return true once the tones are complete
+bool ftx_encode_step(ftx_encode_job_t *job, int max_rows);
+
+/// Share of a resumable encode that is done, counting the CRC, each LDPC row and the tone mapping as one unit
+/// @return 0..100
+int ftx_encode_progress(const ftx_encode_job_t *job);
+
 #endif // _INCLUDE_ENCODE_H_
@@ -0,0 +1,162 @@
+#include "verify.h"
+#include "constants.h"
+#include "crc.h"
+
+// Inverse of kFT8_Gray_map / kFT4_Gray_map (channel symbols -> FTx bits)
+static const uint8_t kFT8_Gray_inverse[8] = {0, 1, 3, 2, 6, 4, 5, 7};
+static const uint8_t kFT4_Gray_inverse[4] = {0, 1, 3, 2};
+
+// Append the lowest num_bits of value to the codeword (MSB first)
+static void put_bits(uint8_t *codeword, int *i_bit, uint8_t value, int num_bits)
+{
+    for (int i = num_bits - 1; i >= 0; --i)
+    {
+        if (value & (1u << i))
+            codeword[*i_bit / 8] |= (0x80u >> (*i_bit % 8));
+        ++(*i_bit);
+    }
+}
+
+// Run the LDPC parity checks and the CRC over a recovered codeword,
+// then compare the 77 bit payload with the expected one.
+// [IN] codeword - array of 174 bits stored as 22 bytes (MSB first)
+// [IN] payload  - expected 77 bits of payload, already scrambled for FT4
+static ftx_verify_t check_codeword(const uint8_t *codeword, const uint8_t *payload)
+{
+    // Every parity check row lists the codeword bits (1-origin) that must xor to zero
+    for (int m = 0; m < FTX_LDPC_M; ++m)
+    {
+        uint8_t sum = 0;
+        for (int k = 0; k < kFTX_LDPC_Num_rows[m]; ++k)
+        {
+            int n = kFTX_LDPC_Nm[m][k] - 1;
+            sum ^= (codeword[n / 8] >> (7 - n % 8)) & 1u;
+        }
+        if (sum)
+            return FTX_VERIFY_BAD_PARITY;
+    }
+
+    // The first 91 bits are payload + CRC; the CRC covers the payload zero-extended to 82 bits
+    uint8_t a91[FTX_LDPC_K_BYTES];
+    for (int i = 0; i < FTX_LDPC_K_BYTES; ++i)
+        a91[i] = codeword[i];
+    a91[FTX_LDPC_K_BYTES - 1] &= 0xE0u;
+
+    uint16_t chksum = ftx_extract_crc(a91);
+    a91[9] &= 0xF8u;
+    a91[10] = 0;
+    a91[11] = 0;
+    if (chksum != ftx_compute_crc(a91, 96 - 14))
+        return FTX_VERIFY_BAD_CRC;
+
+    for (int i = 0; i < 10; ++i)
+    {
+        uint8_t mask = (i == 9) ? 0xF8u : 0xFFu; // only 77 bits are significant
+        if ((a91[i] ^ payload[i]) & mask)
+            return FTX_VERIFY_MISMATCH;
+    }
+
+    return FTX_VERIFY_OK;
+}
+
+// i3=0 n3=0 is the free text message type that pack77() falls back to
+static bool is_free_text(const uint8_t *payload)
+{
+    uint8_t i3 = (payload[9] >> 3) & 0x07u;
+    uint8_t n3 = ((payload[8] & 0x01u) << 2) | (payload[9] >> 6);
+    return (i3 == 0) && (n3 == 0);
+}
+
+ftx_verify_t ft8_verify(const uint8_t *tones, const uint8_t *payload)
+{
+    uint8_t codeword[FTX_LDPC_N_BYTES] = {0};
+    int i_bit = 0;
+
+    // Message structure: S7 D29 S7 D29 S7
+    for (int i_tone = 0; i_tone < FT8_NN; ++i_tone)
+    {
+        if (tones[i_tone] > 7)
+            return FTX_VERIFY_BAD_TONE;
+
+        int i_sync = i_tone % FT8_SYNC_OFFSET;
+        if (i_sync < FT8_LENGTH_SYNC)
+        {
+            if (tones[i_tone] != kFT8_Costas_pattern[i_sync])
+                return FTX_VERIFY_BAD_SYNC;
+        }
+        else
+        {
+            put_bits(codeword, &i_bit, kFT8_Gray_inverse[tones[i_tone]], 3);
+        }
+    }
+
+    ftx_verify_t result = check_codeword(codeword, payload);
+    if (result == FTX_VERIFY_OK && is_free_text(payload))
+        return FTX_VERIFY_FREE_TEXT;
+    return result;
+}
+
+ftx_verify_t ft4_verify(const uint8_t *tones, const uint8_t *payload)
+{
+    uint8_t codeword[FTX_LDPC_N_BYTES] = {0};
+    int i_bit = 0;
+
+    // Message structure: R S4_1 D29 S4_2 D29 S4_3 D29 S4_4 R
+    for (int i_tone = 0; i_tone < FT4_NN; ++i_tone)
+    {
+        if (tones[i_tone] > 3)
+            return FTX_VERIFY_BAD_TONE;
+
+        if ((i_tone == 0) || (i_tone == FT4_NN - 1))
+        {
+            if (tones[i_tone] != 0)
+                return FTX_VERIFY_BAD_SYNC;
+            continue;
+        }
+
+        int i_sync = (i_tone - 1) % FT4_SYNC_OFFSET;
+        if (i_sync < FT4_LENGTH_SYNC)
+        {
+            if (tones[i_tone] != kFT4_Costas_pattern[(i_tone - 1) / FT4_SYNC_OFFSET][i_sync])
+                return FTX_VERIFY_BAD_SYNC;
+        }
+        else
+        {
+            put_bits(codeword, &i_bit, kFT4_Gray_inverse[tones[i_tone]], 2);
+        }
+    }
+
+    // FT4 scrambles the payload before computing CRC and parity
+    uint8_t payload_xor[10];
+    for (int i = 0; i < 10; ++i)
+    {
+        payload_xor[i] = payload[i] ^ kFT4_XOR_sequence[i];
+    }
+
+    ftx_verify_t result = check_codeword(codeword, payload_xor);
+    if (result == FTX_VERIFY_OK && is_free_text(payload))
+        return FTX_VERIFY_FREE_TEXT;
+    return result;
+}
+
+const char *ftx_verify_text(ftx_verify_t result)
+{
+    switch (result)
+    {
+    case FTX_VERIFY_OK:
+        return "OK";
+    case FTX_VERIFY_FREE_TEXT:
+        return "FREE_TEXT";
+    case FTX_VERIFY_BAD_TONE:
+        return "BAD_TONE";
+    case FTX_VERIFY_BAD_SYNC:
+        return "BAD_SYNC";
+    case FTX_VERIFY_BAD_PARITY:
+        return "BAD_PARITY";
+    case FTX_VERIFY_BAD_CRC:
+        return "BAD_CRC";
+    case FTX_VERIFY_MISMATCH:
+        return "MISMATCH";
+    }
+    return "UNKNOWN";
+}
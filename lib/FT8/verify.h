@@ -0,0 +1,34 @@
+#ifndef _INCLUDE_VERIFY_H_
+#define _INCLUDE_VERIFY_H_
+
+#include <stdint.h>
+
+typedef enum
+{
+    FTX_VERIFY_OK,         ///< Tones carry the expected payload
+    FTX_VERIFY_FREE_TEXT,  ///< Tones carry the expected payload, but it was packed as free text (i3=0 n3=0)
+    FTX_VERIFY_BAD_TONE,   ///< A tone index is out of range for the protocol
+    FTX_VERIFY_BAD_SYNC,   ///< Sync (Costas) or ramp symbols are corrupted
+    FTX_VERIFY_BAD_PARITY, ///< One or more LDPC parity checks fail
+    FTX_VERIFY_BAD_CRC,    ///< CRC-14 does not match the recovered payload
+    FTX_VERIFY_MISMATCH    ///< Recovered payload differs from the expected one
+} ftx_verify_t;
+
+/// Check a FT8 tone sequence against the payload it should carry.
+/// The tones are mapped back to the 174-bit codeword, which is then checked
+/// against the sync pattern, the LDPC parity checks (kFTX_LDPC_Nm) and the CRC.
+/// @param[in] tones   - array of FT8_NN (79) tones as produced by ft8_encode()
+/// @param[in] payload - 10 byte array consisting of the expected 77 bit payload
+/// @return FTX_VERIFY_OK or FTX_VERIFY_FREE_TEXT on success, otherwise the first failed check
+ftx_verify_t ft8_verify(const uint8_t *tones, const uint8_t *payload);
+
+/// Check a FT4 tone sequence against the payload it should carry.
+/// @param[in] tones   - array of FT4_NN (105) tones as produced by ft4_encode()
+/// @param[in] payload - 10 byte array consisting of the expected 77 bit payload (before XOR scrambling)
+/// @return FTX_VERIFY_OK or FTX_VERIFY_FREE_TEXT on success, otherwise the first failed check
+ftx_verify_t ft4_verify(const uint8_t *tones, const uint8_t *payload);
+
+/// Short human readable name of a verification result
+const char *ftx_verify_text(ftx_verify_t result);
+
+#endif // _INCLUDE_VERIFY_H_
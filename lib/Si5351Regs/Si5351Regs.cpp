@@ -0,0 +1,302 @@
+#include "Si5351Regs.h"
+#include <math.h>
+
+const si5351_band_t kSi5351_Bands[SI5351_NUM_BANDS] = {
+    {1800000, 2000000},   // 160 m
+    {3500000, 4000000},   // 80 m
+    {5250000, 5450000},   // 60 m
+    {7000000, 7300000},   // 40 m
+    {10100000, 10150000}, // 30 m
+    {14000000, 14350000}, // 20 m
+    {18068000, 18168000}, // 17 m
+    {21000000, 21450000}, // 15 m
+    {24890000, 24990000}, // 12 m
+    {28000000, 29700000}, // 10 m
+};
+
+// Scale freq into the multisynth range and return the matching R divider (2^r_div)
+static uint8_t select_r_div(uint64_t *freq)
+{
+    uint8_t r_div = 0;
+
+    if (*freq < SI5351_OUT_MIN_FREQ)
+        *freq = SI5351_OUT_MIN_FREQ;
+
+    // Below 128 times the minimum output the multisynth runs faster and R divides it down
+    while (r_div < 7 && (*freq << r_div) < SI5351_OUT_MIN_FREQ * 128u)
+    {
+        ++r_div;
+    }
+    *freq <<= r_div;
+
+    return r_div;
+}
+
+void si5351_ms_calc(uint64_t freq, uint64_t pll_freq, si5351_frac_t *frac)
+{
+    frac->r_div = select_r_div(&freq);
+
+    if (freq > SI5351_MS_MAX_FREQ)
+        freq = SI5351_MS_MAX_FREQ;
+
+    // Integer part of the division, limited to the valid multisynth range
+    uint64_t a = pll_freq / freq;
+    if (a < SI5351_MS_A_MIN)
+        freq = pll_freq / SI5351_MS_A_MIN;
+    if (a > SI5351_MS_A_MAX)
+        freq = pll_freq / SI5351_MS_A_MAX;
+
+    frac->a = (uint32_t)(pll_freq / freq);
+    frac->b = (uint32_t)((pll_freq % freq * SI5351_RFRAC_DENOM) / freq);
+    frac->c = frac->b ? (uint32_t)SI5351_RFRAC_DENOM : 1;
+}
+
+void si5351_encode(const si5351_frac_t *frac, si5351_image_t *image)
+{
+    uint32_t p1 = 128 * frac->a + ((128 * frac->b) / frac->c) - 512;
+    uint32_t p2 = 128 * frac->b - frac->c * ((128 * frac->b) / frac->c);
+    uint32_t p3 = frac->c;
+
+    image->regs[0] = (uint8_t)(p3 >> 8);
+    image->regs[1] = (uint8_t)p3;
+    image->regs[2] = (uint8_t)((frac->r_div & 0x07) << 4) | (uint8_t)((p1 >> 16) & 0x03);
+    image->regs[3] = (uint8_t)(p1 >> 8);
+    image->regs[4] = (uint8_t)p1;
+    image->regs[5] = (uint8_t)((p3 >> 12) & 0xF0) | (uint8_t)((p2 >> 16) & 0x0F);
+    image->regs[6] = (uint8_t)(p2 >> 8);
+    image->regs[7] = (uint8_t)p2;
+}
+
+uint8_t si5351_image_diff(const si5351_image_t *from, const si5351_image_t *to, uint8_t *first)
+{
+    int lo = 0;
+    int hi = SI5351_IMAGE_LEN - 1;
+
+    while (lo < SI5351_IMAGE_LEN && from->regs[lo] == to->regs[lo])
+        ++lo;
+    if (lo == SI5351_IMAGE_LEN)
+        return 0;
+    while (from->regs[hi] == to->regs[hi])
+        --hi;
+
+    *first = (uint8_t)lo;
+    return (uint8_t)(hi - lo + 1);
+}
+
+uint64_t si5351_corrected_ref(uint32_t xtal_freq, int32_t correction)
+{
+    uint64_t ref_freq = (uint64_t)xtal_freq * 100ULL;
+    return ref_freq + (int32_t)((((((int64_t)correction) << 31) / 1000000000LL) * ref_freq) >> 31);
+}
+
+// Even multisynth dividers that keep low..high (0.01 Hz) inside the VCO range
+static bool divider_range(uint64_t low, uint64_t high, uint32_t *div_min, uint32_t *div_max)
+{
+    *div_min = (uint32_t)((SI5351_VCO_MIN + low - 1) / low + 1) & ~1u;
+    *div_max = (uint32_t)(SI5351_VCO_MAX / high) & ~1u;
+    if (*div_min < SI5351_MS_A_MIN)
+        *div_min = SI5351_MS_A_MIN;
+    if (*div_max > SI5351_MS_A_MAX)
+        *div_max = SI5351_MS_A_MAX;
+    return *div_min <= *div_max;
+}
+
+// Valid divider range for the band containing freq, or for freq..top outside the bands
+static bool band_range(uint64_t freq, uint64_t top, uint32_t *div_min, uint32_t *div_max)
+{
+    for (int i = 0; i < SI5351_NUM_BANDS; ++i)
+    {
+        uint64_t low = kSi5351_Bands[i].low * 100ULL;
+        uint64_t high = kSi5351_Bands[i].high * 100ULL;
+        if (freq >= low && freq <= high)
+            return divider_range(low, (top > high) ? top : high, div_min, div_max);
+    }
+    return divider_range(freq, top, div_min, div_max);
+}
+
+// (x + y / 2) / y
+static uint64_t div_round(uint64_t x, uint64_t y)
+{
+    return (x + y / 2) / y;
+}
+
+// Closest fraction p / q to num / den with p <= max_p and q <= max_q: the last convergent of
+// the continued fraction that fits, or the semiconvergent after it if that is closer
+static void best_fraction(uint64_t num, uint64_t den, uint64_t max_p, uint64_t max_q, uint64_t *p, uint64_t *q)
+{
+    double target = (double)num / (double)den;
+    uint64_t p0 = 0, q0 = 1, p1 = 1, q1 = 0;
+    while (den)
+    {
+        uint64_t t = num / den;
+        uint64_t t_max = p1 ? (max_p - p0) / p1 : UINT64_MAX;
+        if (q1 && (max_q - q0) / q1 < t_max)
+            t_max = (max_q - q0) / q1;
+        if (t > t_max)
+        {
+            uint64_t ps = t_max * p1 + p0;
+            uint64_t qs = t_max * q1 + q0;
+            if (qs && (!q1 || fabs(target - (double)ps / qs) < fabs(target - (double)p1 / q1)))
+            {
+                p1 = ps;
+                q1 = qs;
+            }
+            break;
+        }
+        uint64_t p2 = t * p1 + p0;
+        uint64_t q2 = t * q1 + q0;
+        p0 = p1;
+        q0 = q1;
+        p1 = p2;
+        q1 = q2;
+        uint64_t r = num % den;
+        num = den;
+        den = r;
+    }
+    *p = p1;
+    *q = q1;
+}
+
+// Reduce num / den by their gcd. A fraction that is still too large for the planner's 64 bit
+// products is replaced by its closest fraction with both terms up to SI5351_SPACING_MAX
+static bool reduce_spacing(uint32_t *num, uint32_t *den)
+{
+    if (*num == 0 || *den == 0)
+        return false;
+    uint32_t x = *num, y = *den;
+    while (y)
+    {
+        uint32_t t = x % y;
+        x = y;
+        y = t;
+    }
+    *num /= x;
+    *den /= x;
+    if (*num <= SI5351_SPACING_MAX && *den <= SI5351_SPACING_MAX)
+        return true;
+
+    uint64_t p, q;
+    best_fraction(*num, *den, SI5351_SPACING_MAX, SI5351_SPACING_MAX, &p, &q);
+    if (p == 0 || q == 0)
+        return false;
+    *num = (uint32_t)p;
+    *den = (uint32_t)q;
+    return true;
+}
+
+bool si5351_plan(uint64_t ref_freq, uint64_t base_freq, uint32_t spacing_num, uint32_t spacing_den, uint8_t max_tone, si5351_plan_t *plan)
+{
+    // Keeps every product below 2^64, see the bounds noted below
+    if (!reduce_spacing(&spacing_num, &spacing_den))
+        return false;
+
+    // Every divider in the range covers the whole band (and the highest tone),
+    // so the choice only trades accuracy, never the ability to retune within the band.
+    // 100 * num * max_tone < 2^16 * 2^7 * 2^8
+    uint64_t top_freq = base_freq + div_round(100ULL * spacing_num * max_tone, spacing_den);
+    uint32_t div_min, div_max;
+    if (!band_range(base_freq, top_freq, &div_min, &div_max))
+        return false;
+    if (div_min < SI5351_MS_FRAC_MIN)
+        div_min = SI5351_MS_FRAC_MIN;
+
+    // Tone spacing in 0.01 Hz
+    double spacing = 100.0 * spacing_num / spacing_den;
+
+    plan->max_err = UINT32_MAX;
+    for (uint32_t div = div_max - 1; div >= div_min && div + SI5351_PLAN_DIVIDERS > div_max; --div)
+    {
+        // The MS divider lies in div..div + 1. c = n0 * ref / (ms * base) with n0 = step * base / spacing
+        // gives step_max for c <= 2^20 and an MS near div + 1 / 2, away from the sparse fractions
+        // next to an integer. 2^20 * 100 * 2^16 * 2^12 < 2^64
+        // Larger steps make n0 larger and the spacing finer, so the largest SI5351_PLAN_STEPS are tried
+        uint64_t step_max = (uint64_t)SI5351_FRAC_DENOM_MAX * 100ULL * spacing_num * (2 * div + 1) / (2ULL * spacing_den * ref_freq);
+        uint64_t step_min = (step_max > SI5351_PLAN_STEPS) ? step_max - SI5351_PLAN_STEPS : 0;
+
+        for (uint64_t step = step_max; step > step_min; --step)
+        {
+            // n0 / step is base / spacing to within 1 / 2 of n0, which makes the tone steps exact to
+            // a few parts in 1e8. c <= 2^20 bounds n0 to about 36 * 2^20, so n0 * ref < 2^26 * 2^32
+            uint64_t n0 = div_round(step * base_freq * spacing_den, 100ULL * spacing_num);
+            uint64_t c = div_round(2 * n0 * ref_freq, (2 * div + 1) * base_freq);
+            if (c < 2 || c > SI5351_FRAC_DENOM_MAX)
+                continue;
+
+            // PLL between 600 and 900 MHz for the base and the highest tone
+            uint64_t n_top = n0 + step * max_tone;
+            if (n0 * ref_freq < SI5351_VCO_MIN * c || n_top * ref_freq > SI5351_VCO_MAX * c)
+                continue;
+
+            // The MS that puts the base tone exactly on base_freq is n0 * ref / (c * base),
+            // its fraction is approximated with a denominator up to 2^20. c * base < 2^20 * 2^35
+            uint64_t ms_num = n0 * ref_freq;
+            uint64_t ms_den = c * base_freq;
+            uint64_t ms_a = ms_num / ms_den;
+            if (ms_a < div_min || ms_a > div_max)
+                continue;
+            uint64_t ms_b, ms_c;
+            best_fraction(ms_num % ms_den, ms_den, SI5351_FRAC_DENOM_MAX, SI5351_FRAC_DENOM_MAX, &ms_b, &ms_c);
+            if (ms_b >= ms_c)
+                continue;
+
+            // Worst deviation of a tone: base error plus max_tone times the spacing error
+            double ms = (double)ms_a + (double)ms_b / ms_c;
+            double base = (double)ref_freq * n0 / c / ms;
+            double step_freq = (double)ref_freq * step / c / ms;
+            double err = fabs(base - (double)base_freq) + fabs(step_freq - spacing) * max_tone;
+            double err_uhz = err * 10000.0;
+
+            if (err_uhz < plan->max_err)
+            {
+                plan->ms_div = (uint32_t)ms_a;
+                plan->ms_b = (uint32_t)ms_b;
+                plan->ms_c = (uint32_t)ms_c;
+                plan->c = (uint32_t)c;
+                plan->n0 = n0;
+                plan->step = (uint32_t)step;
+                plan->max_err = (err_uhz >= UINT32_MAX) ? UINT32_MAX - 1 : (uint32_t)err_uhz;
+                if (plan->max_err <= SI5351_PLAN_GOOD_ERR)
+                    return true;
+            }
+        }
+    }
+
+    return plan->max_err != UINT32_MAX;
+}
+
+void si5351_plan_pll(const si5351_plan_t *plan, uint8_t tone, si5351_frac_t *frac)
+{
+    uint64_t n = plan->n0 + (uint64_t)plan->step * tone;
+    frac->a = (uint32_t)(n / plan->c);
+    frac->b = (uint32_t)(n % plan->c);
+    frac->c = plan->c;
+    frac->r_div = 0;
+}
+
+void si5351_plan_ms(const si5351_plan_t *plan, si5351_frac_t *frac)
+{
+    frac->a = plan->ms_div;
+    frac->b = plan->ms_b;
+    frac->c = plan->ms_c;
+    frac->r_div = 0;
+}
+
+bool si5351_plan_ms_int(const si5351_plan_t *plan)
+{
+    return plan->ms_b == 0 && (plan->ms_div & 1) == 0;
+}
+
+double si5351_model_ratio(const si5351_image_t *image)
+{
+    uint32_t p1 = ((uint32_t)(image->regs[2] & 0x03) << 16) | ((uint32_t)image->regs[3] << 8) | image->regs[4];
+    uint32_t p2 = ((uint32_t)(image->regs[5] & 0x0F) << 16) | ((uint32_t)image->regs[6] << 8) | image->regs[7];
+    uint32_t p3 = ((uint32_t)(image->regs[5] & 0xF0) << 12) | ((uint32_t)image->regs[0] << 8) | image->regs[1];
+
+    return (p1 + 512.0 + (double)p2 / p3) / 128.0;
+}
+
+double si5351_model_output(uint64_t ref_freq, const si5351_image_t *pll, const si5351_image_t *ms)
+{
+    uint8_t r_div = (ms->regs[2] >> 4) & 0x07;
+    return (double)ref_freq * si5351_model_ratio(pll) / si5351_model_ratio(ms) / (double)(1u << r_div);
+}
@@ -0,0 +1,130 @@
+/*
+Register level helpers for the Si5351 PLL and multisynth dividers.
+The math follows the Etherkit Si5351 library and AN619, but only produces
+register images, so tone frequencies can be computed once before a
+transmission and written as short I2C bursts while it is on air.
+Nothing here touches the bus, so the same code doubles as a host side
+model of the register to frequency math.
+ */
+
+#ifndef _INCLUDE_SI5351_REGS_H_
+#define _INCLUDE_SI5351_REGS_H_
+
+#include <stdint.h>
+
+#define SI5351_IMAGE_LEN (8)                       ///< Registers per divider block (P3, P1, P2 + R_DIV)
+#define SI5351_RFRAC_DENOM (1000000ULL)            ///< Fractional denominator used by the Etherkit library
+#define SI5351_MS_MAX_FREQ (150000000ULL * 100ULL) ///< Highest multisynth output without DIVBY4, 0.01 Hz units
+#define SI5351_OUT_MIN_FREQ (4000ULL * 100ULL)     ///< Lowest clock output (after the R divider), 0.01 Hz units
+#define SI5351_MS_A_MIN (6)                        ///< Smallest integer part of a multisynth divider
+#define SI5351_MS_A_MAX (1800)                     ///< Largest integer part of a multisynth divider
+#define SI5351_MS_FRAC_MIN (8)                     ///< Smallest fractional multisynth divider (AN619)
+#define SI5351_VCO_MIN (600000000ULL * 100ULL)     ///< Lowest PLL (VCO) frequency in 0.01 Hz units
+#define SI5351_VCO_MAX (900000000ULL * 100ULL)     ///< Highest PLL (VCO) frequency in 0.01 Hz units
+#define SI5351_FRAC_DENOM_MAX (1048575UL)          ///< Largest fractional denominator (20 bits)
+#define SI5351_NUM_BANDS (10)                      ///< Entries in kSi5351_Bands
+#define SI5351_PLAN_DIVIDERS (16)                  ///< Output dividers tried by si5351_plan()
+#define SI5351_PLAN_STEPS (64)                     ///< Numerator steps per tone tried for each divider, largest first
+#define SI5351_PLAN_GOOD_ERR (100)                 ///< Plan error (micro Hz) that ends the search early
+#define SI5351_SPACING_MAX (65535UL)               ///< Largest tone spacing numerator and denominator used by the planner
+
+/// Fractional divider a + b / c, followed by an output divider of 2^r_div
+typedef struct
+{
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint8_t r_div;
+} si5351_frac_t;
+
+/// Image of one 8 register divider block (e.g. registers 42..49 for MS0)
+typedef struct
+{
+    uint8_t regs[SI5351_IMAGE_LEN];
+} si5351_image_t;
+
+/// Band edges in Hz
+typedef struct
+{
+    uint32_t low;
+    uint32_t high;
+} si5351_band_t;
+
+/// HF amateur bands from 160 m to 10 m. The planner picks dividers valid for the whole band
+extern const si5351_band_t kSi5351_Bands[SI5351_NUM_BANDS];
+
+/// Tone plan for one transmission.
+/// The output multisynth is a fixed divider ms_div + ms_b / ms_c and the PLL feedback divider
+/// is n / c with a fixed c, so every tone is reached by changing n only:
+/// no multisynth update, no PLL reset and no phase glitch between tones.
+/// The fraction of the multisynth trims the base frequency, n0 / step sets the tone spacing.
+typedef struct
+{
+    uint32_t ms_div;  ///< Integer part of the output multisynth divider
+    uint32_t ms_b;    ///< Fractional numerator of the output multisynth divider
+    uint32_t ms_c;    ///< Fractional denominator of the output multisynth divider
+    uint32_t c;       ///< Fractional denominator of the PLL feedback divider
+    uint64_t n0;      ///< Feedback numerator (over c) of the base frequency
+    uint32_t step;    ///< Feedback numerator change per tone
+    uint32_t max_err; ///< Worst deviation of the base or any tone from its nominal frequency, in micro Hz
+} si5351_plan_t;
+
+/// Compute the multisynth divider that produces freq from pll_freq.
+/// Uses the same R divider selection and fractional math as Si5351::set_freq(),
+/// so the image matches what the library would program for the same frequency.
+/// @param[in] freq     - output frequency in 0.01 Hz
+/// @param[in] pll_freq - frequency of the PLL feeding the multisynth in 0.01 Hz
+/// @param[out] frac    - divider parameters
+void si5351_ms_calc(uint64_t freq, uint64_t pll_freq, si5351_frac_t *frac);
+
+/// Encode divider parameters into a register image (MSx_P1/P2/P3, R_DIV as in AN619)
+void si5351_encode(const si5351_frac_t *frac, si5351_image_t *image);
+
+/// Find the span of registers that differ between two images
+/// @param[in] from   - image currently in the chip
+/// @param[in] to     - image to be written
+/// @param[out] first - index of the first differing register
+/// @return number of registers from first up to and including the last differing one, 0 if equal
+uint8_t si5351_image_diff(const si5351_image_t *from, const si5351_image_t *to, uint8_t *first);
+
+/// Reference frequency after calibration, computed the way the Etherkit library does
+/// @param[in] xtal_freq  - crystal frequency in Hz
+/// @param[in] correction - calibration in parts per billion, as passed to set_correction()
+/// @return corrected reference in 0.01 Hz
+uint64_t si5351_corrected_ref(uint32_t xtal_freq, int32_t correction);
+
+/// Plan a transmission whose tones are base_freq + k * spacing, k = 0..max_tone.
+/// For each multisynth range valid for the whole band and each numerator step, n0 is chosen so
+/// n0 / step matches base / spacing, and the multisynth fraction (denominator up to 2^20) that
+/// puts tone 0 on base_freq. The combination with the smallest worst case error of base and tones wins.
+/// Any spacing is accepted, fractions with large terms are approximated to SI5351_SPACING_MAX.
+/// @param[in] ref_freq    - PLL reference in 0.01 Hz, see si5351_corrected_ref()
+/// @param[in] base_freq   - frequency of tone 0 in 0.01 Hz
+/// @param[in] spacing_num - tone spacing in Hz is spacing_num / spacing_den
+/// @param[in] spacing_den
+/// @param[in] max_tone    - highest tone index in the message
+/// @param[out] plan       - resulting plan
+/// @return false if the frequency cannot be reached or the spacing is finer than one feedback numerator step
+bool si5351_plan(uint64_t ref_freq, uint64_t base_freq, uint32_t spacing_num, uint32_t spacing_den, uint8_t max_tone, si5351_plan_t *plan);
+
+/// PLL feedback divider for a tone of a plan (encode with si5351_encode() for registers 26..33 / 34..41)
+void si5351_plan_pll(const si5351_plan_t *plan, uint8_t tone, si5351_frac_t *frac);
+
+/// Output multisynth divider of a plan (fractional unless ms_b is 0)
+void si5351_plan_ms(const si5351_plan_t *plan, si5351_frac_t *frac);
+
+/// Whether the output multisynth of a plan may run in integer mode (MSx_INT).
+/// AN619 only allows it for an even integer divide ratio, so an exact odd divider stays fractional
+bool si5351_plan_ms_int(const si5351_plan_t *plan);
+
+/// Divider ratio held by a register image, (P1 + 512 + P2 / P3) / 128
+double si5351_model_ratio(const si5351_image_t *image);
+
+/// Output frequency produced by a PLL and a multisynth register image
+/// @param[in] ref_freq - PLL reference in 0.01 Hz
+/// @param[in] pll      - image of the PLL feedback divider (MSNA/MSNB)
+/// @param[in] ms       - image of the output multisynth (MSx, including R_DIV)
+/// @return output frequency in 0.01 Hz
+double si5351_model_output(uint64_t ref_freq, const si5351_image_t *pll, const si5351_image_t *ms);
+
+#endif // _INCLUDE_SI5351_REGS_H_
@@ -0,0 +1,25 @@
+#include "SymbolClock.h"
+
+void symbol_clock_init(symbol_clock_t *clock, uint32_t num, uint32_t den)
+{
+    clock->period_us = (uint32_t)(1000000ULL * num / den);
+    clock->period_rem = (uint32_t)(1000000ULL * num % den);
+    clock->period_den = den;
+    clock->deadline = 0;
+    clock->deadline_rem = 0;
+}
+
+void symbol_clock_advance(symbol_clock_t *clock)
+{
+    clock->deadline += clock->period_us;
+    // deadline_rem + period_rem >= period_den, without overflowing for denominators above 2^31
+    if (clock->deadline_rem >= clock->period_den - clock->period_rem)
+    {
+        clock->deadline_rem -= clock->period_den - clock->period_rem;
+        clock->deadline++;
+    }
+    else
+    {
+        clock->deadline_rem += clock->period_rem;
+    }
+}
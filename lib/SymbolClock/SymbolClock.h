@@ -0,0 +1,33 @@
+/*
+Symbol deadlines for a transmission with an exact fractional symbol period.
+The period num / den seconds is split into whole microseconds and a remainder
+in 1 / den us. Every advance adds both and carries the remainder Bresenham
+style, so symbol i is due at exactly floor(i * period) us and rounding never
+accumulates, however long the transmission.
+ */
+
+#ifndef _INCLUDE_SYMBOL_CLOCK_H_
+#define _INCLUDE_SYMBOL_CLOCK_H_
+
+#include <stdint.h>
+
+/// Deadline of the next symbol, counted from the start of the transmission
+typedef struct
+{
+    uint32_t period_us;    ///< Whole microseconds of the symbol period
+    uint32_t period_rem;   ///< Remainder of the symbol period in 1 / period_den us
+    uint32_t period_den;   ///< Denominator of the remainder
+    uint32_t deadline;     ///< Due time of the next symbol in us
+    uint32_t deadline_rem; ///< Fractional part of deadline, in 1 / period_den us
+} symbol_clock_t;
+
+/// Set the symbol period to num / den seconds and the deadline to 0
+/// @param[out] clock - clock to initialize
+/// @param[in] num    - symbol period numerator, in s
+/// @param[in] den    - symbol period denominator, not 0
+void symbol_clock_init(symbol_clock_t *clock, uint32_t num, uint32_t den);
+
+/// Move the deadline on by one symbol period
+void symbol_clock_advance(symbol_clock_t *clock);
+
+#endif // _INCLUDE_SYMBOL_CLOCK_H_
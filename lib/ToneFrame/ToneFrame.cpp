@@ -0,0 +1,90 @@
+#include "ToneFrame.h"
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+tone_frame_result_t tone_frame_parse(const uint8_t *buf, size_t len, tone_frame_t *frame)
+{
+    if (len < TONE_FRAME_HEADER_LEN)
+        return TONE_FRAME_SHORT;
+    if ((((uint16_t)buf[0] << 8) | buf[1]) != TONE_FRAME_MAGIC)
+        return TONE_FRAME_BAD_MAGIC;
+
+    frame->type = buf[2];
+    if (frame->type != TONE_FRAME_TYPE_MESSAGE && frame->type != TONE_FRAME_TYPE_STREAM)
+        return TONE_FRAME_BAD_TYPE;
+    if (len < tone_frame_header_len(frame))
+        return TONE_FRAME_SHORT;
+
+    frame->channel = buf[3];
+    frame->frequency = ((uint64_t)get_u32(&buf[4]) << 32) | get_u32(&buf[8]);
+    frame->spacing_mhz = get_u32(&buf[12]);
+    frame->period_us = get_u32(&buf[16]);
+    frame->bits = buf[20];
+    frame->count = buf[21];
+    frame->first = (frame->type == TONE_FRAME_TYPE_STREAM) ? get_u32(&buf[22]) : 0;
+
+    if (frame->frequency == 0 || frame->spacing_mhz == 0 || frame->period_us == 0)
+        return TONE_FRAME_BAD_FORMAT;
+    // an empty stream frame marks the end of the stream
+    if (frame->bits == 0 || frame->bits > 8 || (frame->count == 0 && frame->type != TONE_FRAME_TYPE_STREAM))
+        return TONE_FRAME_BAD_FORMAT;
+
+    return TONE_FRAME_OK;
+}
+
+size_t tone_frame_header_len(const tone_frame_t *frame)
+{
+    return (frame->type == TONE_FRAME_TYPE_STREAM) ? TONE_FRAME_STREAM_HEADER_LEN : TONE_FRAME_HEADER_LEN;
+}
+
+size_t tone_frame_payload_len(const tone_frame_t *frame)
+{
+    return ((size_t)frame->count * frame->bits + 7) / 8;
+}
+
+void tone_frame_unpack(const tone_frame_t *frame, const uint8_t *data, size_t len, size_t offset, uint8_t *tones)
+{
+    // Whole bytes per tone need no bit shuffling
+    if (frame->bits == 8)
+    {
+        for (size_t i = 0; i < len && offset + i < frame->count; ++i)
+            tones[offset + i] = data[i];
+        return;
+    }
+
+    size_t i_bit = offset * 8;
+    for (size_t i = 0; i < len; ++i)
+    {
+        for (int b = 7; b >= 0; --b, ++i_bit)
+        {
+            size_t i_tone = i_bit / frame->bits;
+            if (i_tone >= frame->count)
+                return;
+            if (data[i] & (1u << b))
+                tones[i_tone] |= 1u << (frame->bits - 1 - i_bit % frame->bits);
+        }
+    }
+}
+
+const char *tone_frame_text(tone_frame_result_t result)
+{
+    switch (result)
+    {
+    case TONE_FRAME_OK:
+        return "OK";
+    case TONE_FRAME_SHORT:
+        return "SHORT";
+    case TONE_FRAME_BAD_MAGIC:
+        return "BAD_MAGIC";
+    case TONE_FRAME_BAD_TYPE:
+        return "BAD_TYPE";
+    case TONE_FRAME_BAD_FORMAT:
+        return "BAD_FORMAT";
+    case TONE_FRAME_REJECTED:
+        return "REJECTED";
+    }
+    return "UNKNOWN";
+}
@@ -0,0 +1,88 @@
+/*
+Binary tone frames, for playing symbols generated on a host.
+A frame carries the base frequency, tone spacing and symbol period of the
+transmission followed by the tones packed MSB first with 1 to 8 bits each.
+Multi-byte fields are in network byte order, like the WSJT-X UDP messages.
+
+Offset Size Field
+0      2    magic, 'T' 'F'
+2      1    type, TONE_FRAME_TYPE_MESSAGE or TONE_FRAME_TYPE_STREAM
+3      1    channel (Si5351 output)
+4      8    base frequency in 0.01 Hz
+12     4    tone spacing in mHz
+16     4    symbol period in us
+20     1    bits per tone (1..8)
+21     1    number of tones (1..255, 0 ends a stream)
+22     4    stream frames only: stream index of the first tone
+22/26  ...  packed tones, ceil(tones * bits / 8) bytes
+
+A message frame is a whole transmission. Stream frames are pieces of an open
+ended transmission; the index of their first tone places them in time, so
+they may arrive late, twice or out of order.
+
+Parsing never copies the payload: the header is decoded in place and the
+tones are unpacked straight from the receive buffer into the tone buffer
+they are played from, one received chunk at a time.
+ */
+
+#ifndef _INCLUDE_TONE_FRAME_H_
+#define _INCLUDE_TONE_FRAME_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TONE_FRAME_MAGIC (0x5446)         ///< "TF"
+#define TONE_FRAME_TYPE_MESSAGE (1)       ///< A whole message of tones
+#define TONE_FRAME_TYPE_STREAM (2)        ///< A piece of a symbol stream
+#define TONE_FRAME_HEADER_LEN (22)        ///< Bytes before the packed tones of a message frame
+#define TONE_FRAME_STREAM_HEADER_LEN (26) ///< Bytes before the packed tones of a stream frame
+#define TONE_FRAME_MAX_TONES (255)        ///< Largest number of tones in a frame
+
+typedef enum
+{
+    TONE_FRAME_OK,          ///< Valid frame
+    TONE_FRAME_SHORT,       ///< Fewer bytes than the header or the tones need
+    TONE_FRAME_BAD_MAGIC,   ///< Not a tone frame
+    TONE_FRAME_BAD_TYPE,    ///< Unknown frame type
+    TONE_FRAME_BAD_FORMAT,  ///< Zero or out of range field
+    TONE_FRAME_REJECTED     ///< Valid frame that the transmitter could not start
+} tone_frame_result_t;
+
+/// Decoded frame header
+typedef struct
+{
+    uint8_t type;
+    uint8_t channel;
+    uint64_t frequency;   ///< Base frequency in 0.01 Hz
+    uint32_t spacing_mhz; ///< Tone spacing in mHz
+    uint32_t period_us;   ///< Symbol period in us
+    uint8_t bits;         ///< Bits per packed tone
+    uint8_t count;        ///< Number of tones
+    uint32_t first;       ///< Stream index of the first tone, 0 for message frames
+} tone_frame_t;
+
+/// Decode and check a frame header.
+/// @param[in] buf    - start of the frame
+/// @param[in] len    - bytes available at buf, at least the header length of the frame type
+/// @param[out] frame - decoded header
+/// @return TONE_FRAME_OK or the reason the header is not valid
+tone_frame_result_t tone_frame_parse(const uint8_t *buf, size_t len, tone_frame_t *frame);
+
+/// Bytes of the header of frame
+size_t tone_frame_header_len(const tone_frame_t *frame);
+
+/// Bytes of packed tones that follow the header of frame
+size_t tone_frame_payload_len(const tone_frame_t *frame);
+
+/// Unpack a chunk of the packed tones. Chunks may split a tone and may come in any order.
+/// @param[in] frame   - decoded header
+/// @param[in] data    - chunk of the packed tones
+/// @param[in] len     - bytes in data
+/// @param[in] offset  - position of data[0] in the packed tones
+/// @param[out] tones  - frame->count tones, must be zeroed before the first chunk
+void tone_frame_unpack(const tone_frame_t *frame, const uint8_t *data, size_t len, size_t offset, uint8_t *tones);
+
+/// Short human readable name of a parse result
+const char *tone_frame_text(tone_frame_result_t result);
+
+#endif // _INCLUDE_TONE_FRAME_H_
@@ -4,6 +4,9 @@
 #include <rs_common.h>
 #include <int.h>
 #include <string.h>
+#include <atomic>
+#include <time.h>
+#include <sys/time.h>
 #include "Wire.h"
 #include <Rotary.h>
 #if defined(ESP8266)
@@ -17,10 +20,15 @@
 #include <ESPAsyncWebServer.h>
 #include "AsyncJson.h"
 #include "ArduinoJson.h"
+#include <LittleFS.h>
 #include <Morse.h>
 #include "SSD1306Wire.h"
 #include <FT8.h>
+#include <Si5351Regs.h>
+#include <SymbolClock.h>
+#include <ToneFrame.h>
 #include <MyFont.h>
+#include "ModeTiming.h"
 #include <secrets.h>
 
 #define ACTIVE_LOW 0
@@ -48,27 +56,14 @@ const int cwPaddlePinActiveLevel = ACTIVE_LOW;
 const int pttPinActiveLevel = ACTIVE_LOW;
 const int rotaryButtonActiveLevel = ACTIVE_LOW;
 
+const uint8_t displayI2cAddress = 0x3c; // SSD1306, shares the Wire bus with the Si5351
+
 #pragma endregion Pin_definitions
 
 // Digital mode properties
 #pragma region DigitalModeProperties
 
-#define JT9_TONE_SPACING 174  // ~1.74 Hz
-#define JT65_TONE_SPACING 269 // ~2.69 Hz
-#define JT4_TONE_SPACING 437  // ~4.37 Hz
-#define WSPR_TONE_SPACING 146 // ~1.46 Hz
-#define FSQ_TONE_SPACING 879  // ~8.79 Hz
-#define FT8_TONE_SPACING 625  // ~6.25 Hz
-
-#define JT9_DELAY 576     // Delay value for JT9-1
-#define JT65_DELAY 371    // Delay in ms for JT65A
-#define JT4_DELAY 229     // Delay value for JT4A
-#define WSPR_DELAY 683    // Delay value for WSPR
-#define FSQ_2_DELAY 500   // Delay value for 2 baud FSQ
-#define FSQ_3_DELAY 333   // Delay value for 3 baud FSQ
-#define FSQ_4_5_DELAY 222 // Delay value for 4.5 baud FSQ
-#define FSQ_6_DELAY 167   // Delay value for 6 baud FSQ
-#define FT8_DELAY 159     // Delay value for FT8
+// Fraction, the tone spacings and the symbol periods are in ModeTiming.h, shared with the host tests
 
 #define JT9_DEFAULT_FREQ 14078700UL
 #define JT65_DEFAULT_FREQ 14078300UL
@@ -89,42 +84,13 @@ enum DeviceModes
 };
 
 // Text array of the DeviceModes enum. Keep the order and length same
-const String deviceModeTexts[] = {
+const char *deviceModeTexts[] = {
     "Standalone",
     "Webserver",
     "WSJT-X",
 };
 
-enum OperatingModes
-{
-  MODE_CW,
-  MODE_PIXIE_CW,
-  MODE_WSPR,
-  MODE_FT8,
-  MODE_FT4,
-  MODE_FSQ_2,
-  MODE_FSQ_3,
-  MODE_FSQ_4_5,
-  MODE_FSQ_6,
-  MODE_JT9,
-  MODE_JT65,
-  MODE_JT4,
-};
-
-// Text array of the OperatingModes enum. Keep the order and length same
-const String operatingModeTexts[] = {
-    "CW",
-    "PIXIE_CW",
-    "WSPR",
-    "FT8",
-    "FT4",
-    "FSQ_2",
-    "FSQ_3",
-    "FSQ_4_5",
-    "FSQ_6",
-    "JT9",
-    "JT65",
-    "JT4"};
+// OperatingModes and MODE_COUNT are in ModeTiming.h
 
 #pragma endregion Enums
 
@@ -134,8 +100,9 @@ JTEncode jtencode;
 Rotary rotary = Rotary(ROTARY_CLK_PIN, ROTARY_DT_PIN);
 AsyncWebServer server(80);
 Morse morse(0, 15.0F);
-SSD1306Wire display(0x3c, SDA, SCL);
+SSD1306Wire display(displayI2cAddress, SDA, SCL);
 WiFiUDP Udp;
+WiFiUDP toneUdp;
 FT8 ft8;
 
 // common global states
@@ -154,396 +121,3055 @@ char myGridLocator[10] = "NL66WE";
 uint8_t dBm = 33; // 2 watt
 uint8_t txBuffer[255];
 uint8_t symbolCount;
-uint16_t toneDelay, toneSpacing;
+Fraction toneSpacing; // Hz
+Fraction toneDelay;   // symbol period in s
+boolean txActive = false; // a transmission is in progress on any channel
 char IP[16] = "0.0.0.0";
-boolean refreshDisplay = false;
+boolean txVerifyEnabled = true;                // check FT8/FT4 tones against txMessage before keying
+ftx_verify_t lastTxVerify = FTX_VERIFY_OK;      // result of the last tx check
 
 #pragma endregion Common_Global_States
 
+// Cooperative task scheduling
+#pragma region Scheduler
+// loop() runs a few cooperative tasks (see the Tasks region). A task runs when its deadline has
+// passed or when it has been woken from an ISR or a web callback
+#define TASK_SLEEP ULONG_MAX // returned by a task that runs only when woken
+
+// In priority order, the tx engine first
+enum TaskIds
+{
+  TASK_TX,         // symbol deadlines of the tx engine
+  TASK_INPUT,      // rotary encoder and button
+  TASK_STANDALONE, // paddle keyer
+  TASK_COMMANDS,   // commands queued by the web handlers
+  TASK_TXQUEUE,    // encoding and start of queued messages
+  TASK_WEB,        // webserver device mode
+  TASK_WSJTX,      // WSJT-X packets and slot timing
+  TASK_TONES,      // tone frames over UDP
+  TASK_I2C,        // display push in chunks
+  TASK_DISPLAY,    // display render
+  TASK_NET,        // WiFi connection and retries
+  TASK_STATE,      // state snapshot for the web handlers
+  TASK_COUNT
+};
+
+typedef unsigned long (*TaskFunction)();
+unsigned long txTask();
+unsigned long inputTask();
+unsigned long standaloneTask();
+unsigned long commandTask();
+unsigned long txQueueTask();
+unsigned long webTask();
+unsigned long wsjtxTask();
+unsigned long toneTask();
+unsigned long i2cTask();
+unsigned long displayTask();
+unsigned long netTask();
+unsigned long stateTask();
+
+struct Task
+{
+  const char *name;
+  TaskFunction run;          // returns the time in us until the next run, or TASK_SLEEP
+  boolean sleeping;          // waits for taskWake()
+  unsigned long deadline;    // micros() of the next run
+  unsigned long runs;        // times run
+  unsigned long maxRunTime;  // longest run in us
+  unsigned long maxLateness; // longest time a run was due before it started in us
+};
+
+// Every task runs once on the first pass: not sleeping, due at 0
+Task tasks[TASK_COUNT] = {
+    {"tx", txTask, false, 0, 0, 0, 0},
+    {"input", inputTask, false, 0, 0, 0, 0},
+    {"standalone", standaloneTask, false, 0, 0, 0, 0},
+    {"commands", commandTask, false, 0, 0, 0, 0},
+    {"txQueue", txQueueTask, false, 0, 0, 0, 0},
+    {"web", webTask, false, 0, 0, 0, 0},
+    {"wsjtx", wsjtxTask, false, 0, 0, 0, 0},
+    {"tones", toneTask, false, 0, 0, 0, 0},
+    {"i2c", i2cTask, false, 0, 0, 0, 0},
+    {"display", displayTask, false, 0, 0, 0, 0},
+    {"net", netTask, false, 0, 0, 0, 0},
+    {"state", stateTask, false, 0, 0, 0, 0},
+};
+
+volatile boolean taskWoken[TASK_COUNT]; // run on the next scheduler pass, whatever the deadline
+uint64_t schedIdleTime = 0;             // total time loop() slept in us
+
+// Run a task on the next scheduler pass. Safe to call from an ISR
+IRAM_ATTR void taskWake(TaskIds task)
+{
+  taskWoken[task] = true;
+}
+
+// True if a task has been woken since the scheduler last looked
+boolean taskAnyWoken()
+{
+  for (uint8_t i = 0; i < TASK_COUNT; i++)
+    if (taskWoken[i])
+      return true;
+  return false;
+}
+
+#pragma endregion Scheduler
+
+// Heap use of the tasks
+#pragma region HeapCheck
+// Tasks keep to fixed buffers, so the heap stays as fragmented as boot left it. The esp12e_heapcheck
+// environment builds with HEAP_CHECK: malloc, calloc and realloc are wrapped at link time and every
+// allocation made while a task runs is counted against it. The first one of a task is logged.
+// The default build has no wrappers
+#ifdef HEAP_CHECK
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+
+int8_t heapCheckTask = -1;                // task running, -1 outside the tasks
+unsigned long heapTaskAllocs[TASK_COUNT]; // allocations made by each task
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+  if (heapCheckTask >= 0)
+    heapTaskAllocs[heapCheckTask]++;
+  return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+  if (heapCheckTask >= 0)
+    heapTaskAllocs[heapCheckTask]++;
+  return __real_calloc(count, size);
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+  if (heapCheckTask >= 0)
+    heapTaskAllocs[heapCheckTask]++;
+  return __real_realloc(ptr, size);
+}
+
+void heapCheckBegin(uint8_t task)
+{
+  heapCheckTask = task;
+}
+
+void heapCheckEnd(uint8_t task, unsigned long allocsBefore)
+{
+  heapCheckTask = -1;
+  if (allocsBefore == 0 && heapTaskAllocs[task])
+    Serial.printf("Heap check: task %s allocates\n", tasks[task].name);
+}
+
+unsigned long heapCheckAllocs(uint8_t task)
+{
+  return heapTaskAllocs[task];
+}
+#else
+inline void heapCheckBegin(uint8_t) {}
+inline void heapCheckEnd(uint8_t, unsigned long) {}
+inline unsigned long heapCheckAllocs(uint8_t) { return 0; }
+#endif
+
+uint32_t heapMinFree = UINT32_MAX; // lowest free heap seen by statePublish()
+
+uint32_t heapLargestBlock()
+{
+#if defined(ESP8266)
+  return ESP.getMaxFreeBlockSize();
+#else
+  return ESP.getMaxAllocHeap();
+#endif
+}
+#pragma endregion HeapCheck
+
 // Global state setters
 #pragma region GlobalStateSetters
 
+boolean txChannelActive(uint8_t channel);
+boolean selectModeProfile(uint8_t profile);
+void txRequestAbort(uint8_t mask, unsigned long requestTime);
+
 // sets value of frequency
-void setFrequency(const String &value)
+void setFrequency(const char *value)
 {
-  char *pEnd;
-  if (strtoull(value.c_str(), &pEnd, 10))
-    frequency = strtoull(value.c_str(), &pEnd, 10);
+  uint64_t value64 = strtoull(value, NULL, 10);
+  if (value64)
+    frequency = value64;
 
-  // change si5351 frequency
-  si5351.set_freq(frequency, SI5351_CLK0);
+  // change si5351 frequency. While a message is on air the new frequency is used for the next one
+  if (!txChannelActive(0))
+    si5351.set_freq(frequency, SI5351_CLK0);
 }
 
-// sets value of operatingMode
-void setOperatingMode(const String &value)
+// selects the mode profile, which sets operatingMode and the tone timing
+void setOperatingMode(const char *value)
 {
-  operatingMode = static_cast<OperatingModes>(value.toInt());
+  selectModeProfile(atoi(value));
 }
 
 // sets value of txMessage. Max length 99
-void setTxMessage(const String &value)
+void setTxMessage(const char *value)
 {
-  strcpy(txMessage, value.c_str());
+  strlcpy(txMessage, value, sizeof(txMessage));
 }
 
-// sets value of txEnabled
-void setTxEnabled(const String &value)
+// sets value of txEnabled. Disabling stops a message on channel 0 that is on air
+void setTxEnabled(const char *value)
 {
-  if (value == "true")
+  if (strcmp(value, "true") == 0)
+  {
     txEnabled = true;
-  else if (value == "false")
+    taskWake(TASK_WEB);
+  }
+  else if (strcmp(value, "false") == 0)
+  {
     txEnabled = false;
+    txRequestAbort(1 << 0, micros());
+  }
 }
 
 // sets value of wpm
-void setMorseWPM(const String &value)
+void setMorseWPM(const char *value)
 {
-  if (value.toInt())
-    wpm = value.toInt();
+  if (atoi(value))
+    wpm = atoi(value);
 
   morse.setWPM((float)wpm);
 }
 
 // sets value of myCallsign. Max length 9
-void setMyCallsign(const String &value)
+void setMyCallsign(const char *value)
 {
-  strcpy(myCallsign, value.c_str());
+  strlcpy(myCallsign, value, sizeof(myCallsign));
 }
 
 // sets value of dxCallsign. Max length 9
-void setDxCallsign(const String &value)
+void setDxCallsign(const char *value)
 {
-  strcpy(dxCallsign, value.c_str());
+  strlcpy(dxCallsign, value, sizeof(dxCallsign));
 }
 
 // sets value of myGridLocator. Max length 9
-void setMyGrid(const String &value)
+void setMyGrid(const char *value)
+{
+  strlcpy(myGridLocator, value, sizeof(myGridLocator));
+}
+
+// sets value of txVerifyEnabled
+void setTxVerify(const char *value)
 {
-  strcpy(myGridLocator, value.c_str());
+  if (strcmp(value, "true") == 0)
+    txVerifyEnabled = true;
+  else if (strcmp(value, "false") == 0)
+    txVerifyEnabled = false;
 }
 
 // sets value of si5351CalibrationFactor
-void setCalibration(const String &value)
+void setCalibration(const char *value)
 {
-  if (value.toInt())
-    si5351CalibrationFactor = value.toInt();
+  if (atoi(value))
+    si5351CalibrationFactor = atoi(value);
 
-  si5351.set_correction(si5351CalibrationFactor, SI5351_PLL_INPUT_XO);
+  // while a message is on air the correction is applied when it ends
+  if (!txActive)
+    si5351.set_correction(si5351CalibrationFactor, SI5351_PLL_INPUT_XO);
 }
 
 #pragma endregion GlobalStateSetters
 
-// JTEncode logic
-#pragma region JTEncode
-// Loop through the string, transmitting one character at a time.
-void jtTransmitMessage()
+// I2C bus scheduling
+#pragma region I2CBus
+// The Si5351 and the display share one Wire bus. Tone changes are written the moment they are
+// due and always go first. A display frame is never pushed in one go: it is queued and sent from
+// loop() in small chunks, and only while the next symbol deadline is far enough away.
+#define I2C_DISPLAY_CHUNK 16       // display data bytes per I2C transaction
+#define I2C_DEADLINE_GUARD_US 1500 // no display traffic this close to a symbol deadline
+#define I2C_SERVICE_BUDGET_US 2000 // longest time i2cService() keeps the bus per call
+#define DISPLAY_BUFFER_SIZE 1024   // 128 x 64 pixels, one bit each
+
+unsigned long txTimeToDeadline();
+
+boolean i2cFramePending = false;   // a display frame is waiting to be pushed
+boolean i2cFrameAddressed = false; // the column/page window of the current push is set
+uint16_t i2cFrameOffset = 0;       // next display buffer byte to push
+
+// Bus statistics
+unsigned long i2cFrames = 0;       // display frames completed
+unsigned long i2cChunks = 0;       // display chunks written
+unsigned long i2cDeferred = 0;     // display pushes held back because a symbol was due soon
+unsigned long i2cTxWrites = 0;     // Si5351 tone writes
+unsigned long i2cMaxChunkTime = 0; // longest display transaction in us
+uint64_t i2cBusyTime = 0;          // total time spent in scheduled I2C transfers in us
+
+void displayCommand(uint8_t command)
 {
-  uint8_t i;
-
-  // Reset the tone to the base frequency and turn on the output
-  si5351.output_enable(SI5351_CLK0, 1);
-  if (pttPinActiveLevel == ACTIVE_LOW)
-    digitalWrite(PTT_PIN, LOW);
-  else
-    digitalWrite(PTT_PIN, HIGH);
-
-  // Now transmit the channel symbols
-  if (operatingMode == MODE_FSQ_2 || operatingMode == MODE_FSQ_3 || operatingMode == MODE_FSQ_4_5 || operatingMode == MODE_FSQ_6)
-  {
-    uint8_t j = 0;
-
-    while (txBuffer[j++] != 0xff)
-      ;
-
-    symbolCount = j - 1;
-  }
-
-  for (i = 0; i < symbolCount; i++)
-  {
-    si5351.set_freq(frequency + (txBuffer[i] * toneSpacing), SI5351_CLK0);
-    delay(toneDelay);
-  }
-
-  // Turn off the output
-  si5351.output_enable(SI5351_CLK0, 0);
-  if (pttPinActiveLevel == ACTIVE_LOW)
-    digitalWrite(PTT_PIN, HIGH);
-  else
-    digitalWrite(PTT_PIN, LOW);
+  Wire.beginTransmission(displayI2cAddress);
+  Wire.write(0x80);
+  Wire.write(command);
+  Wire.endTransmission();
 }
 
-void setTxBuffer()
+// Queue the display buffer for transfer. A push in progress restarts from the top
+void i2cQueueFrame()
 {
-  // Clear out the transmit buffer
-  memset(txBuffer, 0, 255);
-
-  // Set the proper frequency and timer CTC depending on mode
-  switch (operatingMode)
-  {
-  case MODE_JT9:
-    jtencode.jt9_encode(txMessage, txBuffer);
-    break;
-  case MODE_JT65:
-    jtencode.jt65_encode(txMessage, txBuffer);
-    break;
-  case MODE_JT4:
-    jtencode.jt4_encode(txMessage, txBuffer);
-    break;
-  case MODE_WSPR:
-    jtencode.wspr_encode(myCallsign, myGridLocator, dBm, txBuffer);
-    break;
-  case MODE_FT8:
-    jtencode.ft8_encode(txMessage, txBuffer);
-    break;
-  case MODE_FSQ_2:
-  case MODE_FSQ_3:
-  case MODE_FSQ_4_5:
-  case MODE_FSQ_6:
-    jtencode.fsq_dir_encode(myCallsign, dxCallsign, ' ', txMessage, txBuffer);
-    break;
-  }
+  i2cFramePending = true;
+  i2cFrameAddressed = false;
+  i2cFrameOffset = 0;
+  taskWake(TASK_I2C);
 }
-#pragma endregion JTEncode
 
-// Morse and CW Keyer functionality
-#pragma region MorseAndCWKeyer
-boolean morseTxMsgSet = false;
-unsigned long previousMorseMilis = 0;
+// Account for a Si5351 tone write that kept the bus for the given time
+void i2cCountTxWrite(unsigned long us)
+{
+  i2cTxWrites++;
+  i2cBusyTime += us;
+}
 
-// calculate timings in miliseconds based on the formula: T = 1200 / WPM
-int ditLength = 1200 / wpm;
-int dahLength = 1200 * 3 / wpm;
+// Push queued display chunks while no symbol is due soon. Run by i2cTask()
+void i2cService()
+{
+  unsigned long start = micros();
+  while (i2cFramePending && micros() - start < I2C_SERVICE_BUDGET_US)
+  {
+    if (txTimeToDeadline() < I2C_DEADLINE_GUARD_US)
+    {
+      i2cDeferred++;
+      return;
+    }
 
-// holds the current state of the paddles
-volatile boolean ditState;
-volatile boolean dahState;
+    unsigned long chunkStart = micros();
+    if (!i2cFrameAddressed)
+    {
+      // Full screen window, the controller auto increments through it (horizontal addressing)
+      displayCommand(COLUMNADDR);
+      displayCommand(0);
+      displayCommand(127);
+      displayCommand(PAGEADDR);
+      displayCommand(0);
+      displayCommand(7);
+      i2cFrameAddressed = true;
+    }
+    else
+    {
+      Wire.beginTransmission(displayI2cAddress);
+      Wire.write(0x40);
+      Wire.write(&display.buffer[i2cFrameOffset], I2C_DISPLAY_CHUNK);
+      Wire.endTransmission();
+      i2cFrameOffset += I2C_DISPLAY_CHUNK;
+      i2cChunks++;
+
+      if (i2cFrameOffset >= DISPLAY_BUFFER_SIZE)
+      {
+        i2cFramePending = false;
+        i2cFrames++;
+      }
+    }
 
-// Morse keyer states
-enum MorseStates
+    unsigned long chunkTime = micros() - chunkStart;
+    i2cBusyTime += chunkTime;
+    if (chunkTime > i2cMaxChunkTime)
+      i2cMaxChunkTime = chunkTime;
+  }
+}
+#pragma endregion I2CBus
+
+// Symbol engine
+#pragma region TxEngine
+// Every tone change is scheduled against an absolute deadline measured from the start of the
+// transmission (symbol i is due at startTime + floor(i * period)), so I2C latency and
+// loop() jitter do not pile up over the message. txEngineUpdate() is polled from loop().
+// The period is an exact fraction; the deadline advances by its whole microseconds and a
+// Bresenham style remainder carries the rest (see SymbolClock), so rounding never accumulates either.
+//
+// The register image of every tone used by the message is computed before keying.
+// On air a tone change only writes the registers that differ from the current image, in one burst.
+// Normally the tones are stepped on the PLL feedback numerator with the MS held at a fixed
+// divider (see si5351_plan), which is phase continuous. If no plan fits, the MS is stepped instead.
+//
+// Each Si5351 output is a channel with its own mode, frequency, tones and schedule, and all of
+// them can be on air at once. txEngineUpdate() serves the due channels earliest deadline first.
+// A channel only steps its PLL when no other output is sourced from that PLL: setup() gives CLK0
+// PLLA to itself and puts CLK1 and CLK2 on PLLB, so those two step their multisynths.
+// Channel 0 is the main transmitter used by the web and WSJT-X paths.
+#define TX_MAX_TONES 66 // JT65 has the highest tone index (65)
+#define TX_CHANNELS 3   // CLK0..CLK2
+
+struct TxChannel
 {
-  START,
-  DITSTATE,
-  DAHSTATE,
-  ENDCHAR,
-  ENDWORD,
+  enum si5351_clock clk;                   // output driven by the channel
+  boolean active;                          // a transmission is in progress
+  boolean keyed;                           // tones are on/off keying (CW) instead of frequency steps
+  boolean streaming;                       // tones come from txStream instead of tones[]
+  OperatingModes mode;                     // mode of the current transmission
+  uint8_t tones[255];                      // tone of every symbol
+  uint8_t symbolIndex;                     // index of the next symbol to send
+  uint8_t symbolCount;                     // symbols in the current transmission
+  uint64_t frequency;                      // base frequency of the current transmission
+  Fraction toneSpacing;                    // tone spacing of the current transmission in Hz
+  symbol_clock_t clock;                    // symbol period and due time of the next symbol in us after startTime
+  unsigned long startTime;                 // micros() at the start of the transmission
+  unsigned long maxTimingErr;              // worst case lateness of a symbol in the current transmission in us
+  unsigned long lastTimingErr;             // worst case lateness of the last finished transmission in us
+  si5351_image_t toneImages[TX_MAX_TONES]; // register images indexed by tone
+  si5351_image_t currentImage;             // image currently programmed into the stepped block
+  uint8_t imageRegister;                   // first register of the stepped block (PLL or MS)
+  si5351_plan_t plan;                      // tone plan of the current transmission
+  boolean pllStepping;                     // tones are stepped on the PLL instead of the MS
 };
-MorseStates keyerState = START;
 
-// read dit state
-IRAM_ATTR void handleDitInterrupt()
+TxChannel txChannels[TX_CHANNELS]; // channel c drives CLKc, see setup()
+
+// Symbol stream
+// One channel at a time can play an open ended stream of tones instead of a message. Stream
+// frames carry the stream index of their first tone and land in a jitter buffer. Playback starts
+// once TX_STREAM_PREFILL_US of air time is buffered, then the symbols are due one period apart
+// like those of a message. A symbol that has not arrived by its deadline is an underrun and the
+// previous tone is held; tones that arrive after their deadline are late and dropped. The stream
+// ends on an empty frame, or when it runs dry TX_STREAM_TIMEOUT_US after the last frame
+#define TX_STREAM_SIZE 256            // jitter buffer in symbols, a power of two
+#define TX_STREAM_MAX_TONE 63         // highest tone of a stream, so at most 6 bits per tone
+#define TX_STREAM_PREFILL_US 250000UL // buffered air time before playback starts
+#define TX_STREAM_TIMEOUT_US 2000000UL
+#define TX_REBASE_US 0x40000000UL // a streaming channel moves startTime up before its deadline gets this far
+static_assert(TX_STREAM_MAX_TONE < TX_MAX_TONES, "stream tones index toneImages");
+
+struct TxStream
 {
-  // Get the pin reading.
-  if (cwPaddlePinActiveLevel == ACTIVE_LOW)
-    ditState = !digitalRead(DIT_PIN);
-  else
-    ditState = !!digitalRead(DIT_PIN);
-}
+  boolean open;                        // frames are accepted
+  boolean ending;                      // the end frame has arrived, stop when the buffer runs dry
+  uint8_t channel;                     // channel the stream plays on
+  uint64_t frequency;                  // base frequency
+  Fraction spacing;                    // tone spacing in Hz
+  Fraction period;                     // symbol period in s
+  uint8_t maxTone;                     // highest tone the bits per tone allow
+  uint32_t prefill;                    // symbols buffered before playback starts
+  uint32_t next;                       // stream index of the next symbol to play
+  uint32_t head;                       // one past the highest stream index received
+  unsigned long lastFrame;             // micros() of the last frame
+  uint8_t tones[TX_STREAM_SIZE];       // tones by stream index modulo TX_STREAM_SIZE
+  uint8_t present[TX_STREAM_SIZE / 8]; // the tone of a slot has arrived, one bit each
+  unsigned long frames;                // frames received
+  unsigned long lateFrames;            // frames with tones that arrived after their deadline
+  unsigned long underruns;             // symbols that were due before they arrived
+  unsigned long overruns;              // tones dropped because they were too far ahead
+};
 
-// read dah state
-IRAM_ATTR void handleDahInterrupt()
-{
-  // Get the pin reading.
-  if (cwPaddlePinActiveLevel == ACTIVE_LOW)
-    dahState = !digitalRead(DAH_PIN);
-  else
-    dahState = !!digitalRead(DAH_PIN);
-}
+TxStream txStream;
 
-// Turn output off
-void keyUp()
+boolean txChannelActive(uint8_t channel)
 {
-  if (pttPinActiveLevel == ACTIVE_LOW)
-    digitalWrite(PTT_PIN, HIGH);
-  else
-    digitalWrite(PTT_PIN, LOW);
-
-  noTone(BUZZER_PIN);
-  si5351.output_enable(SI5351_CLK0, 0);
+  return channel < TX_CHANNELS && txChannels[channel].active;
 }
-// Turn output on
-void keyDown()
+
+void txSetPtt(boolean on)
 {
-  if (pttPinActiveLevel == ACTIVE_LOW)
+  if ((pttPinActiveLevel == ACTIVE_LOW) == on)
     digitalWrite(PTT_PIN, LOW);
   else
     digitalWrite(PTT_PIN, HIGH);
-
-  tone(BUZZER_PIN, 1000);
-  si5351.output_enable(SI5351_CLK0, 1);
 }
 
-// state variables for CW
-boolean sendingDit = false;
-boolean completedDit = false;
-unsigned long lastDitTriggerd = 0;
-
-boolean sendingDah = false;
-boolean completedDah = false;
-unsigned long lastDahTriggerd = 0;
-
-boolean keyerIdle = false;
-unsigned long lastKeyerIdleTriggered = 0;
-
-boolean nextKeyerStateSet = false;
-MorseStates nextKeyerState;
-#pragma endregion MorseAndCWKeyer
-
-// Rotary Encoder logic
-#pragma region RotaryEncoder
-volatile int rotaryCounter = 0;
-IRAM_ATTR void handleRotate()
+// True if no other output is sourced from the PLL of clk
+boolean txPllExclusive(enum si5351_clock clk)
 {
-  // (a%b + b)%b use this formula while using rotaryCounter
-  unsigned char result = rotary.process();
-  if (result == DIR_CW)
-  {
-    rotaryCounter++;
-  }
-  else if (result == DIR_CCW)
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
   {
-    rotaryCounter--;
+    if (c != clk && si5351.pll_assignment[c] == si5351.pll_assignment[clk])
+      return false;
   }
+  return true;
 }
 
-volatile boolean rotaryButtonPressed = false; // this flag should be reset where it is used
-IRAM_ATTR void handleRotarySwitchPress()
+// Compute the register image of every tone in ch.tones[0..ch.symbolCount).
+// Returns false if the buffer holds a tone the engine has no room for
+boolean txPrepareImages(TxChannel &ch)
 {
-  // Get the pin reading.
-  if (rotaryButtonActiveLevel == ACTIVE_LOW)
+  uint8_t computed[(TX_MAX_TONES + 7) / 8] = {0};
+  uint8_t maxTone = 0;
+  for (uint8_t i = 0; i < ch.symbolCount; i++)
   {
-    if (!digitalRead(ROTARY_SW_PIN))
-      rotaryButtonPressed = true;
+    if (ch.tones[i] >= TX_MAX_TONES)
+      return false;
+    if (ch.tones[i] > maxTone)
+      maxTone = ch.tones[i];
   }
+
+  // The tones of a stream are not known in advance, it gets every tone it can send
+  uint16_t imageCount = ch.symbolCount;
+  if (ch.streaming)
+  {
+    maxTone = txStream.maxTone;
+    imageCount = maxTone + 1;
+  }
+
+  enum si5351_pll pll = si5351.pll_assignment[ch.clk];
+  uint64_t pllFreq = (pll == SI5351_PLLA) ? si5351.plla_freq : si5351.pllb_freq;
+  uint64_t refFreq = si5351_corrected_ref(si5351.xtal_freq[SI5351_PLL_INPUT_XO], si5351.get_correction(SI5351_PLL_INPUT_XO));
+
+  // Keyed channels have no tone steps, their single image is the base frequency on the MS
+  ch.pllStepping = !ch.keyed && txPllExclusive(ch.clk) &&
+                   si5351_plan(refFreq, ch.frequency, ch.toneSpacing.num, ch.toneSpacing.den, maxTone, &ch.plan);
+  if (ch.pllStepping)
+    ch.imageRegister = (pll == SI5351_PLLA) ? SI5351_PLLA_PARAMETERS : SI5351_PLLB_PARAMETERS;
   else
+    ch.imageRegister = SI5351_CLK0_PARAMETERS + SI5351_IMAGE_LEN * ch.clk;
+
+  for (uint16_t i = 0; i < imageCount; i++)
   {
-    if (!!digitalRead(ROTARY_SW_PIN))
-      rotaryButtonPressed = true;
+    uint8_t tone = ch.streaming ? i : (ch.keyed ? 0 : ch.tones[i]);
+    if (computed[tone / 8] & (1 << (tone % 8)))
+      continue;
+
+    si5351_frac_t frac;
+    if (ch.pllStepping)
+      si5351_plan_pll(&ch.plan, tone, &frac);
+    else
+      si5351_ms_calc(ch.frequency + (100ULL * tone * ch.toneSpacing.num + ch.toneSpacing.den / 2) / ch.toneSpacing.den, pllFreq, &frac);
+    si5351_encode(&frac, &ch.toneImages[tone]);
+    computed[tone / 8] |= (1 << (tone % 8));
   }
+  return true;
 }
-#pragma endregion RotaryEncoder
-
-// WSJTX UDP
-#pragma region WSJTX
-const unsigned int localUdpPort = 2237; // local port to listen on
-uint8_t WSJTX_incomingByteArray[255];   // buffer for incoming packets
-size_t WSJTX_currentIndex = 0;
 
-// WSJTX helper functions
-uint8 readuInt8()
+// Write only the registers that differ from the current image, in one I2C burst
+void txWriteImage(TxChannel &ch, const si5351_image_t &image)
 {
-  uint8 val;
-  memcpy(&val, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(val));
-  WSJTX_currentIndex += 1;
-  return val;
+  uint8_t first;
+  uint8_t count = si5351_image_diff(&ch.currentImage, &image, &first);
+  if (count)
+  {
+    unsigned long start = micros();
+    si5351.si5351_write_bulk(ch.imageRegister + first, count, (uint8_t *)&image.regs[first]);
+    i2cCountTxWrite(micros() - start);
+  }
+  ch.currentImage = image;
 }
 
-uint32 readuInt32()
+// Microseconds until the next symbol of any channel is due, ULONG_MAX when not transmitting
+unsigned long txTimeToDeadline()
 {
-  uint32 bigEndianValue;
-  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
-  WSJTX_currentIndex += 4;
-  uint32 theUnpackedValue = ntohl(bigEndianValue);
-  return theUnpackedValue;
+  unsigned long nearest = ULONG_MAX;
+  unsigned long t = micros();
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+  {
+    TxChannel &ch = txChannels[c];
+    if (!ch.active)
+      continue;
+
+    unsigned long elapsed = t - ch.startTime;
+    unsigned long remaining = (elapsed >= ch.clock.deadline) ? 0 : ch.clock.deadline - elapsed;
+    if (remaining < nearest)
+      nearest = remaining;
+  }
+  return nearest;
 }
 
-int32 readInt32()
+// Turn off the output of a channel, and PTT when it was the last one on air
+void txKeyDown(TxChannel &ch)
 {
-  int32 bigEndianValue;
-  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
-  WSJTX_currentIndex += 4;
-  int32 theUnpackedValue = ntohl(bigEndianValue);
-  return theUnpackedValue;
+  si5351.output_enable(ch.clk, 0);
+  ch.active = false;
+  if (ch.streaming)
+  {
+    ch.streaming = false;
+    txStream.open = false;
+  }
+  ch.lastTimingErr = ch.maxTimingErr;
+
+  txActive = false;
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+    txActive = txActive || txChannels[c].active;
+  if (!txActive)
+    txSetPtt(false);
 }
 
-uint64 readuInt64()
+// The registers were written behind the library's back, bring the PLL and the MS of a keyed
+// down channel back to what the library expects and CLK0 back to the dial frequency.
+// set_correction() reprograms both PLLs, so a calibration change made during TX waits until
+// every channel is off
+void txRestore(TxChannel &ch)
 {
-  uint64 bigEndianValue;
-  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
-  WSJTX_currentIndex += 8;
-  uint64 theUnpackedValue = __builtin_bswap64(bigEndianValue);
-  return theUnpackedValue;
+  enum si5351_pll pll = si5351.pll_assignment[ch.clk];
+  if (!txActive && si5351.get_correction(SI5351_PLL_INPUT_XO) != si5351CalibrationFactor)
+    si5351.set_correction(si5351CalibrationFactor, SI5351_PLL_INPUT_XO);
+  else if (ch.pllStepping)
+    si5351.set_pll((pll == SI5351_PLLA) ? si5351.plla_freq : si5351.pllb_freq, pll);
+  si5351.set_freq((ch.clk == SI5351_CLK0) ? frequency : ch.frequency, ch.clk);
+  if (ch.pllStepping)
+    si5351.pll_reset(pll);
 }
 
-bool readBool()
+void txStop(TxChannel &ch)
 {
-  bool val;
-  memcpy(&val, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(val));
-  WSJTX_currentIndex += 1;
-  return val;
+  txKeyDown(ch);
+  Serial.printf("TX%u done, worst case timing error %lu us\n", ch.clk, ch.lastTimingErr);
+  txRestore(ch);
 }
 
-#pragma endregion WSJTX
+// Abort requests from the web handlers, WSJT-X and the rotary button. They are served by
+// txEngineUpdate() before it sends the next symbol, so the channels key down well within a symbol
+volatile uint8_t txAbortMask = 0;               // channels to abort, one bit each
+volatile unsigned long txAbortRequestTime = 0;  // micros() of the oldest pending request
+unsigned long txAborts = 0;                     // aborts served
+unsigned long txLastAbortLatency = 0;           // us from request to key down of the last abort
+unsigned long txMaxAbortLatency = 0;            // worst case abort latency in us
 
-// Webserver
-#pragma region Webserver
-// function to send JSON response
-void sendJSON(AsyncWebServerRequest *request, const String &message)
+// Ask for the channels in mask to stop. requestTime is micros() when the request was made
+void txRequestAbort(uint8_t mask, unsigned long requestTime)
 {
-  AsyncJsonResponse *response = new AsyncJsonResponse();
-  response->addHeader("Server", "ESP Async Web Server");
-  JsonVariant &root = response->getRoot();
-  root["freq"] = frequency;
-  root["opMode"] = operatingMode;
-  root["txMsg"] = txMessage;
-  root["myCall"] = myCallsign;
-  root["dxCall"] = dxCallsign;
-  root["dBm"] = dBm;
-  root["txEn"] = txEnabled;
-  root["myGrid"] = myGridLocator;
-  root["cal"] = si5351CalibrationFactor;
-  root["wpm"] = wpm;
-  root["message"] = message;
-  response->setLength();
-  request->send(response);
+  if (!txAbortMask)
+    txAbortRequestTime = requestTime;
+  txAbortMask |= mask;
+  taskWake(TASK_TX);
 }
 
-#pragma endregion Webserver
-
-// Display functionality
-#pragma region Display
-
-// Primary frame. Shows the most important device states
-void showScreen1()
+// Microseconds until the last symbol of a channel has been sent, 0 when it is idle. A stream
+// has no last symbol, so its end is that of the tones buffered so far. It moves on as frames arrive
+unsigned long txTimeToEnd(uint8_t channel)
 {
-  display.clear();
-
-  display.setFont(Roboto_Mono_Thin_16);
-  display.drawString(0, 0, String((double)frequency / 100000000, 6U) + "MHz");
-
-  display.setFont(ArialMT_Plain_10);
-  display.drawString(0, 20, "Mode: " + deviceModeTexts[deviceMode]);
-  display.drawString(0, 30, "OpMode: " + operatingModeTexts[operatingMode]);
-  display.drawString(0, 40, "WPM: " + String(wpm));
-  display.drawString(0, 50, "IP: " + String(IP));
-
-  display.display();
+  if (!txChannelActive(channel))
+    return 0;
+
+  TxChannel &ch = txChannels[channel];
+  unsigned long symbols = ch.streaming ? txStream.head - txStream.next : ch.symbolCount - ch.symbolIndex;
+  unsigned long elapsed = micros() - ch.startTime;
+  unsigned long next = (elapsed >= ch.clock.deadline) ? 0 : ch.clock.deadline - elapsed;
+  return next + symbols * ch.clock.period_us;
 }
 
-void showScreenWSJTX()
+// Key down every requested channel first, then put their registers back in order
+void txServeAbort()
 {
-  display.clear();
+  uint8_t mask = txAbortMask;
+  unsigned long requestTime = txAbortRequestTime;
+  txAbortMask = 0;
+
+  uint8_t stopped = 0;
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+  {
+    if ((mask & (1 << c)) && txChannels[c].active)
+    {
+      txKeyDown(txChannels[c]);
+      stopped |= (1 << c);
+    }
+  }
+  if (!stopped)
+    return;
+
+  txLastAbortLatency = micros() - requestTime;
+  if (txLastAbortLatency > txMaxAbortLatency)
+    txMaxAbortLatency = txLastAbortLatency;
+  txAborts++;
+
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+  {
+    if (stopped & (1 << c))
+    {
+      Serial.printf("TX%u aborted at symbol %u of %u, %lu us after the request\n",
+                    c, txChannels[c].symbolIndex, txChannels[c].symbolCount, txLastAbortLatency);
+      txRestore(txChannels[c]);
+    }
+  }
+}
+
+void txAdvanceDeadline(TxChannel &ch)
+{
+  symbol_clock_advance(&ch.clock);
+}
+
+// Take the tone of the next stream symbol. Returns false if it has not arrived
+boolean txStreamPop(uint8_t &tone)
+{
+  uint16_t slot = txStream.next % TX_STREAM_SIZE;
+  boolean arrived = txStream.present[slot / 8] & (1 << (slot % 8));
+  txStream.present[slot / 8] &= ~(1 << (slot % 8));
+  txStream.next++;
+  tone = txStream.tones[slot];
+  return arrived;
+}
+
+// Streaming counterpart of the message part of txSendSymbol()
+void txStreamSymbol(TxChannel &ch)
+{
+  // Keep the deadline small so an endless stream never wraps the micros() arithmetic
+  if (ch.clock.deadline >= TX_REBASE_US)
+  {
+    ch.startTime += ch.clock.deadline;
+    ch.clock.deadline = 0;
+  }
+
+  if (txStream.next >= txStream.head && (txStream.ending || micros() - txStream.lastFrame > TX_STREAM_TIMEOUT_US))
+  {
+    txStop(ch);
+    return;
+  }
+
+  uint8_t tone;
+  if (txStreamPop(tone))
+    txWriteImage(ch, ch.toneImages[tone]);
+  else
+    txStream.underruns++;
+  ch.symbolIndex++;
+}
+
+// Send the symbol of a channel whose deadline has passed by late us
+void txSendSymbol(TxChannel &ch, unsigned long late)
+{
+  if (late > ch.maxTimingErr)
+    ch.maxTimingErr = late;
+
+  txAdvanceDeadline(ch);
+  if (ch.streaming)
+  {
+    txStreamSymbol(ch);
+    return;
+  }
+
+  // the deadline after the last symbol ends the transmission
+  if (ch.symbolIndex >= ch.symbolCount)
+  {
+    txStop(ch);
+    return;
+  }
+
+  uint8_t tone = ch.tones[ch.symbolIndex];
+  if (!ch.keyed)
+  {
+    txWriteImage(ch, ch.toneImages[tone]);
+  }
+  else if (tone != ch.tones[ch.symbolIndex - 1])
+  {
+    unsigned long start = micros();
+    si5351.output_enable(ch.clk, tone ? 1 : 0);
+    i2cCountTxWrite(micros() - start);
+  }
+  ch.symbolIndex++;
+}
+
+// Send the symbols that are due, the most overdue channel first. Cheap when nothing is due
+void txEngineUpdate()
+{
+  if (txAbortMask)
+    txServeAbort();
+
+  while (txActive)
+  {
+    TxChannel *due = NULL;
+    unsigned long dueLate = 0;
+    unsigned long t = micros();
+    for (uint8_t c = 0; c < TX_CHANNELS; c++)
+    {
+      TxChannel &ch = txChannels[c];
+      if (!ch.active)
+        continue;
+
+      unsigned long elapsed = t - ch.startTime;
+      if (elapsed >= ch.clock.deadline && (due == NULL || elapsed - ch.clock.deadline > dueLate))
+      {
+        due = &ch;
+        dueLate = elapsed - ch.clock.deadline;
+      }
+    }
+    if (due == NULL)
+      return;
+
+    txSendSymbol(*due, dueLate);
+  }
+}
+
+// Program the MS and the first tone of a prepared channel and key it up
+void txBegin(TxChannel &ch, uint8_t firstTone, unsigned long startTime)
+{
+  if (ch.pllStepping)
+  {
+    // The MS stays at the plan's divider for the whole message, its fraction trims the base.
+    // Integer mode only for an even integer divider (AN619)
+    si5351_frac_t msFrac;
+    si5351_image_t msImage;
+    si5351_plan_ms(&ch.plan, &msFrac);
+    si5351_encode(&msFrac, &msImage);
+    si5351.si5351_write_bulk(SI5351_CLK0_PARAMETERS + SI5351_IMAGE_LEN * ch.clk, SI5351_IMAGE_LEN, msImage.regs);
+    si5351.set_int(ch.clk, si5351_plan_ms_int(&ch.plan));
+  }
+
+  // Program the first tone in full, later symbols only write what changes
+  ch.currentImage = ch.toneImages[ch.keyed ? 0 : firstTone];
+  si5351.si5351_write_bulk(ch.imageRegister, SI5351_IMAGE_LEN, ch.currentImage.regs);
+  if (ch.pllStepping)
+    si5351.pll_reset(si5351.pll_assignment[ch.clk]);
+
+  // Turn on the output, keyed channels follow the key state of the symbol
+  si5351.output_enable(ch.clk, ch.keyed ? firstTone : 1);
+  txSetPtt(true);
+
+  ch.active = true;
+  txActive = true;
+  ch.startTime = startTime;
+  txEngineUpdate();
+  taskWake(TASK_TX);
+}
+
+// Start sending count tones on a channel, symbol 0 being due at micros() == startTime.
+// Returns immediately, the symbols are sent by txEngineUpdate(). Returns false if the channel
+// is busy, the tones can not be sent or startTime is so far back that the message is over.
+// startTime must not be in the future. tones may be the channel's own buffer
+boolean txStart(uint8_t channel, OperatingModes mode, uint64_t freq, const uint8_t *tones, uint8_t count, Fraction spacing, Fraction period, unsigned long startTime)
+{
+  if (channel >= TX_CHANNELS || txChannels[channel].active)
+    return false;
+
+  // Latch the parameters, the caller's buffers may change while the message is on air
+  TxChannel &ch = txChannels[channel];
+  if (tones != ch.tones)
+    memcpy(ch.tones, tones, count);
+  ch.mode = mode;
+  ch.keyed = (mode == MODE_CW);
+  ch.streaming = false;
+  ch.frequency = freq;
+  ch.toneSpacing = spacing;
+  symbol_clock_init(&ch.clock, period.num, period.den);
+  ch.symbolCount = count;
+  ch.maxTimingErr = 0;
+
+  if (ch.symbolCount == 0 || !txPrepareImages(ch))
+  {
+    Serial.printf("TX%u aborted, invalid tone buffer\n", channel);
+    return false;
+  }
+
+  // A late start skips the symbols that are already over and joins the one in progress
+  // at the right tone, so the message still ends on time. On time, the first symbol is 0
+  unsigned long late = micros() - startTime;
+  uint8_t first = 0;
+  txAdvanceDeadline(ch);
+  while (ch.clock.deadline <= late && first < ch.symbolCount)
+  {
+    first++;
+    txAdvanceDeadline(ch);
+  }
+  if (first >= ch.symbolCount)
+  {
+    Serial.printf("TX%u aborted, started %lu us after the message should have ended\n", channel, late);
+    return false;
+  }
+  if (first)
+    Serial.printf("TX%u started %lu us late, skipping %u symbols\n", channel, late, first);
+  ch.symbolIndex = first + 1;
+
+  txBegin(ch, ch.tones[first], startTime);
+  return true;
+}
+
+// Start playing the open stream on its channel, its next symbol being due now.
+// Returns false if the channel is busy
+boolean txStartStream()
+{
+  TxChannel &ch = txChannels[txStream.channel];
+  if (ch.active)
+    return false;
+
+  ch.mode = MODE_RAW;
+  ch.keyed = false;
+  ch.streaming = true;
+  ch.frequency = txStream.frequency;
+  ch.toneSpacing = txStream.spacing;
+  symbol_clock_init(&ch.clock, txStream.period.num, txStream.period.den);
+  ch.symbolCount = 0;
+  ch.symbolIndex = 1;
+  ch.maxTimingErr = 0;
+  txPrepareImages(ch);
+
+  uint8_t tone;
+  if (!txStreamPop(tone))
+    txStream.underruns++;
+  txAdvanceDeadline(ch);
+  txBegin(ch, tone, micros());
+  return true;
+}
+#pragma endregion TxEngine
+
+// Mode profiles
+#pragma region ModeProfiles
+// Every built in mode has a ModeDescriptor, indexed by OperatingModes and fixed at compile time:
+// its encoder, its tone timing and how WSJT-X names and schedules it. At boot each descriptor
+// becomes a ModeProfile, so profile i < MODE_COUNT is mode i. Variants such as JT65B or a slow
+// WSPR are loaded from /modes.json and reuse a built in encoder with their own timing.
+#define MODE_PROFILES_MAX 24       // built in and loaded profiles
+#define MODE_NAME_LEN 12           // longest profile name + 1
+#define MODE_FILE "/modes.json"    // profile file on LittleFS
+#define MODE_FILE_JSON_SIZE 4096   // JSON document size used to read MODE_FILE
+#define WSJTX_MODE_SLOTS 16        // size of the WSJT-X mode name hash table
+
+// Encode message into tones, returns the number of symbols. Defined in the JTEncode region
+typedef uint8_t (*ModeEncoder)(char *message, uint8_t *tones);
+uint8_t encodeCw(char *message, uint8_t *tones);
+uint8_t encodeWspr(char *message, uint8_t *tones);
+uint8_t encodeFt8(char *message, uint8_t *tones);
+uint8_t encodeFt4(char *message, uint8_t *tones);
+uint8_t encodeFsq(char *message, uint8_t *tones);
+uint8_t encodeJt9(char *message, uint8_t *tones);
+uint8_t encodeJt65(char *message, uint8_t *tones);
+uint8_t encodeJt4(char *message, uint8_t *tones);
+
+struct ModeDescriptor
+{
+  OperatingModes mode;    // the descriptor's own index, checked below
+  const char *name;       // shown on the display and the web page
+  const char *wsjtxName;  // mode name in WSJT-X status messages, nullptr if WSJT-X does not run it
+  ModeEncoder encode;     // nullptr if the mode is not sent by the tx engine
+  boolean stationMessage; // sends myCallsign, myGridLocator and dBm instead of the message
+  uint8_t tones;          // distinct tones
+  Fraction spacing;       // tone spacing in Hz, the symbol period is modePeriods[mode]
+  uint32_t slotMs;        // slot length in ms, 0 if the mode is not sent in time slots
+  uint32_t offsetMs;      // start of the transmission within its slot in ms
+};
+
+constexpr ModeDescriptor modeDescriptors[MODE_COUNT] = {
+    {MODE_CW, "CW", nullptr, encodeCw, false, 2, {0, 1}, 0, 0},
+    {MODE_PIXIE_CW, "PIXIE_CW", nullptr, nullptr, false, 0, {0, 1}, 0, 0},
+    {MODE_WSPR, "WSPR", "WSPR", encodeWspr, true, 4, WSPR_TONE_SPACING, 120000, 1000},
+    {MODE_FT8, "FT8", "FT8", encodeFt8, false, 8, FT8_TONE_SPACING, 15000, 500},
+    {MODE_FT4, "FT4", "FT4", encodeFt4, false, 4, FT4_TONE_SPACING, 7500, 500},
+    {MODE_FSQ_2, "FSQ_2", nullptr, encodeFsq, false, 33, FSQ_TONE_SPACING, 0, 0},
+    {MODE_FSQ_3, "FSQ_3", nullptr, encodeFsq, false, 33, FSQ_TONE_SPACING, 0, 0},
+    {MODE_FSQ_4_5, "FSQ_4_5", nullptr, encodeFsq, false, 33, FSQ_TONE_SPACING, 0, 0},
+    {MODE_FSQ_6, "FSQ_6", nullptr, encodeFsq, false, 33, FSQ_TONE_SPACING, 0, 0},
+    {MODE_JT9, "JT9", "JT9", encodeJt9, false, 9, JT9_TONE_SPACING, 60000, 1000},
+    {MODE_JT65, "JT65", "JT65", encodeJt65, false, 66, JT65_TONE_SPACING, 60000, 1000},
+    {MODE_JT4, "JT4", "JT4", encodeJt4, false, 4, JT4_TONE_SPACING, 60000, 1000},
+    {MODE_RAW, "RAW", nullptr, nullptr, false, 0, {0, 1}, 0, 0},
+};
+
+// WSJT-X mode names hash to distinct slots: FT8 6, FT4 14, WSPR 11, JT9 12, JT65 4, JT4 2
+constexpr uint8_t wsjtxModeHash(const char *name, size_t length)
+{
+  return (uint8_t)(name[0] + 2 * name[length - 1]) % WSJTX_MODE_SLOTS;
+}
+
+constexpr int8_t wsjtxModeSlots[WSJTX_MODE_SLOTS] = {
+    -1, -1, MODE_JT4, -1, MODE_JT65, -1, MODE_FT8, -1,
+    -1, -1, -1, MODE_WSPR, MODE_JT9, -1, MODE_FT4, -1};
+
+constexpr size_t constLength(const char *text)
+{
+  return *text ? 1 + constLength(text + 1) : 0;
+}
+
+// Every descriptor sits at its own index and every WSJT-X name at its hash slot
+constexpr boolean modeDescriptorsValid(uint8_t i)
+{
+  return i >= MODE_COUNT ||
+         (modeDescriptors[i].mode == i &&
+          (!modeDescriptors[i].wsjtxName ||
+           wsjtxModeSlots[wsjtxModeHash(modeDescriptors[i].wsjtxName, constLength(modeDescriptors[i].wsjtxName))] == i) &&
+          modeDescriptorsValid(i + 1));
+}
+static_assert(modeDescriptorsValid(0), "modeDescriptors out of order or wsjtxModeSlots out of date");
+
+struct ModeProfile
+{
+  char name[MODE_NAME_LEN]; // shown on the display and the web page
+  OperatingModes encoder;   // built in mode whose encoder makes the tones
+  uint8_t tones;            // distinct tones, 0 if the mode is not sent by the tx engine
+  Fraction spacing;         // tone spacing in Hz
+  Fraction period;          // symbol period in s. CW follows the keyer speed instead
+  uint32_t slotMs;          // slot length in ms, 0 if the mode is not sent in time slots
+  uint32_t offsetMs;        // start of the transmission within its slot in ms
+};
+
+ModeProfile modeProfiles[MODE_PROFILES_MAX];
+uint8_t modeProfileCount = 0;
+uint8_t modeProfile = MODE_CW; // profile of the messages sent on channel 0
+
+// Built in mode called name, -1 if there is none
+int8_t findBuiltinMode(const char *name)
+{
+  for (uint8_t i = 0; i < MODE_COUNT; i++)
+    if (strcmp(modeDescriptors[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+// Built in mode WSJT-X calls name, -1 if there is none
+int8_t wsjtxFindMode(const char *name)
+{
+  size_t length = strlen(name);
+  if (length == 0)
+    return -1;
+
+  int8_t mode = wsjtxModeSlots[wsjtxModeHash(name, length)];
+  if (mode < 0 || strcmp(modeDescriptors[mode].wsjtxName, name) != 0)
+    return -1;
+  return mode;
+}
+
+// Profile of a built in mode
+void modeProfileInit(OperatingModes mode, ModeProfile &p)
+{
+  const ModeDescriptor &d = modeDescriptors[mode];
+  strcpy(p.name, d.name);
+  p.encoder = mode;
+  p.tones = d.encode ? d.tones : 0;
+  p.spacing = d.spacing;
+  p.period = modePeriods[mode];
+  p.slotMs = d.slotMs;
+  p.offsetMs = d.offsetMs;
+}
+
+// Index of the profile called name, -1 if there is none
+int8_t findModeProfile(const char *name)
+{
+  for (uint8_t i = 0; i < modeProfileCount; i++)
+    if (strcmp(modeProfiles[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+// Select the profile of channel 0 and the timing jtTransmitMessage() sends txBuffer with.
+// Returns false and changes nothing if there is no such profile
+boolean selectModeProfile(uint8_t profile)
+{
+  if (profile >= modeProfileCount)
+    return false;
+
+  const ModeProfile &p = modeProfiles[profile];
+  modeProfile = profile;
+  operatingMode = p.encoder;
+  toneSpacing = p.spacing;
+  toneDelay = p.period;
+  return true;
+}
+
+// Tone spacing and symbol period of a profile. Returns false if it is not sent by the tx engine
+boolean getModeTiming(uint8_t profile, Fraction &spacing, Fraction &period)
+{
+  if (profile >= modeProfileCount || modeProfiles[profile].tones == 0)
+    return false;
+
+  const ModeProfile &p = modeProfiles[profile];
+  spacing = p.spacing;
+  if (p.encoder == MODE_CW)
+    period = {6, 5 * (uint32_t)wpm}; // one dit, 1.2 / wpm s
+  else
+    period = p.period;
+  return true;
+}
+
+// Slot length and start offset in ms of a profile, as WSJT-X runs it.
+// Returns false for profiles that are not sent in time slots
+boolean getModeSlot(uint8_t profile, uint32_t &slotMs, uint32_t &offsetMs)
+{
+  if (profile >= modeProfileCount || modeProfiles[profile].slotMs == 0)
+    return false;
+
+  slotMs = modeProfiles[profile].slotMs;
+  offsetMs = modeProfiles[profile].offsetMs;
+  return true;
+}
+
+// Read a fraction written as [num, den]. Leaves f unchanged if value is not one
+void readFraction(JsonVariant value, Fraction &f)
+{
+  if (!value.is<JsonArray>() || value.size() != 2 || value[1].as<uint32_t>() == 0)
+    return;
+  f.num = value[0].as<uint32_t>();
+  f.den = value[1].as<uint32_t>();
+}
+
+// Fill the profile table with the built in profiles and the ones in MODE_FILE, e.g.
+// [{"name": "JT65B", "encoder": "JT65", "spacing": [11025, 2048]}]
+// Fields that are left out are taken from the encoder's profile. A loaded profile with the name
+// of an existing one replaces it. Without a mounted LittleFS only the built in profiles are set up
+void loadModeProfiles(boolean mounted)
+{
+  for (uint8_t i = 0; i < MODE_COUNT; i++)
+    modeProfileInit(static_cast<OperatingModes>(i), modeProfiles[i]);
+  modeProfileCount = MODE_COUNT;
+
+  if (!mounted)
+    return;
+
+  File file = LittleFS.open(MODE_FILE, "r");
+  if (!file)
+    return;
+
+  DynamicJsonDocument doc(MODE_FILE_JSON_SIZE);
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error)
+  {
+    Serial.printf("%s: %s\n", MODE_FILE, error.c_str());
+    return;
+  }
+
+  JsonArray entries = doc.as<JsonArray>();
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    JsonVariant entry = entries[i];
+    const char *name = entry["name"] | "";
+    int8_t encoder = findBuiltinMode(entry["encoder"] | "");
+    if (!name[0] || strlen(name) >= MODE_NAME_LEN || encoder < 0 || !modeDescriptors[encoder].encode)
+    {
+      Serial.printf("%s: skipping entry %u\n", MODE_FILE, i);
+      continue;
+    }
+
+    ModeProfile p;
+    modeProfileInit(static_cast<OperatingModes>(encoder), p);
+    strcpy(p.name, name);
+    p.tones = entry["tones"] | p.tones;
+    readFraction(entry["spacing"], p.spacing);
+    readFraction(entry["period"], p.period);
+    p.slotMs = entry["slot"] | p.slotMs;
+    p.offsetMs = entry["offset"] | p.offsetMs;
+    if (p.tones == 0 || p.tones > TX_MAX_TONES || (p.slotMs && p.offsetMs >= p.slotMs))
+    {
+      Serial.printf("%s: bad timing for %s\n", MODE_FILE, name);
+      continue;
+    }
+
+    int8_t index = findModeProfile(name);
+    if (index < 0)
+    {
+      if (modeProfileCount >= MODE_PROFILES_MAX)
+      {
+        Serial.printf("%s: no room for %s\n", MODE_FILE, name);
+        break;
+      }
+      index = modeProfileCount++;
+    }
+    modeProfiles[index] = p;
+  }
+  Serial.printf("%u mode profiles\n", modeProfileCount);
+}
+
+// Profile WSJT-X means by mode and subMode: a loaded profile named mode + subMode (e.g. JT65 B is
+// "JT65B") that uses the mode's encoder, otherwise the built in one
+uint8_t wsjtxModeProfile(OperatingModes mode, const char *subMode)
+{
+  char name[MODE_NAME_LEN];
+  if (subMode[0] && snprintf(name, sizeof(name), "%s%s", modeDescriptors[mode].name, subMode) < MODE_NAME_LEN)
+  {
+    int8_t index = findModeProfile(name);
+    if (index >= 0 && modeProfiles[index].encoder == mode)
+      return index;
+  }
+  return mode;
+}
+#pragma endregion ModeProfiles
+
+// JTEncode logic
+#pragma region JTEncode
+#define FT4_SYMBOL_COUNT FT4_NN // JTEncode has no FT4, the symbols come from lib/FT8
+
+// Start transmitting txBuffer on channel 0, symbol 0 being due at micros() == startTime.
+// Returns immediately, the symbols are sent by txEngineUpdate()
+boolean jtTransmitMessage(unsigned long startTime)
+{
+  if (txChannelActive(0))
+    return false;
+
+  return txStart(0, operatingMode, frequency, txBuffer, symbolCount, toneSpacing, toneDelay, startTime);
+}
+
+// Morse code of A-Z and 0-9. The elements follow the leading 1 bit, MSB first, 1 is a dah
+const uint8_t morseLetters[26] = {0x05, 0x18, 0x1a, 0x0c, 0x02, 0x12, 0x0e, 0x10, 0x04, 0x17, 0x0d, 0x14, 0x07,
+                                  0x06, 0x0f, 0x16, 0x1d, 0x0a, 0x08, 0x03, 0x09, 0x11, 0x0b, 0x19, 0x1b, 0x1c};
+const uint8_t morseDigits[10] = {0x3f, 0x2f, 0x27, 0x23, 0x21, 0x20, 0x30, 0x38, 0x3c, 0x3e};
+
+uint8_t morseCode(char c)
+{
+  if (c >= 'a' && c <= 'z')
+    return morseLetters[c - 'a'];
+  if (c >= 'A' && c <= 'Z')
+    return morseLetters[c - 'A'];
+  if (c >= '0' && c <= '9')
+    return morseDigits[c - '0'];
+
+  switch (c)
+  {
+  case '/':
+    return 0x32;
+  case '?':
+    return 0x4c;
+  case '=':
+    return 0x31;
+  case '.':
+    return 0x55;
+  case ',':
+    return 0x73;
+  }
+  return 0;
+}
+
+// Encode text as on/off keying symbols of one dit each, 1 is key down. Characters without a
+// morse code are skipped, the text is cut at the last character that fits in 255 symbols.
+// Returns the number of symbols
+uint8_t cwEncode(const char *text, uint8_t *tones)
+{
+  uint8_t count = 0;
+  for (; *text; text++)
+  {
+    if (*text == ' ')
+    {
+      // a word space is 7 dits, the previous character already ended with 3
+      if (count + 4 > 255)
+        break;
+      memset(&tones[count], 0, 4);
+      count += 4;
+      continue;
+    }
+
+    uint8_t code = morseCode(*text);
+    if (!code)
+      continue;
+
+    uint8_t elements = 0;
+    uint16_t length = 2; // character space on top of the last element space
+    for (uint8_t c = code; c > 1; c >>= 1)
+    {
+      length += (c & 1) ? 4 : 2;
+      elements++;
+    }
+    if (count + length > 255)
+      break;
+
+    for (int8_t bit = elements - 1; bit >= 0; bit--)
+    {
+      uint8_t units = ((code >> bit) & 1) ? 3 : 1;
+      memset(&tones[count], 1, units);
+      count += units;
+      tones[count++] = 0;
+    }
+    tones[count++] = 0;
+    tones[count++] = 0;
+  }
+  return count;
+}
+
+uint8_t encodeCw(char *message, uint8_t *tones)
+{
+  return cwEncode(message, tones);
+}
+
+// A station message: sends myCallsign, myGridLocator and dBm, the message is not used
+uint8_t encodeWspr(char *, uint8_t *tones)
+{
+  jtencode.wspr_encode(myCallsign, myGridLocator, dBm, tones);
+  return WSPR_SYMBOL_COUNT;
+}
+
+uint8_t encodeFt8(char *message, uint8_t *tones)
+{
+  ft8.encode(message, tones, false);
+  return FT8_SYMBOL_COUNT;
+}
+
+uint8_t encodeFt4(char *message, uint8_t *tones)
+{
+  ft8.encode(message, tones, true);
+  return FT4_SYMBOL_COUNT;
+}
+
+// FSQ messages are variable length and terminated by 0xff
+uint8_t encodeFsq(char *message, uint8_t *tones)
+{
+  jtencode.fsq_dir_encode(myCallsign, dxCallsign, ' ', message, tones);
+  uint8_t j = 0;
+  while (j < 255 && tones[j] != 0xff)
+    j++;
+  return j;
+}
+
+uint8_t encodeJt9(char *message, uint8_t *tones)
+{
+  jtencode.jt9_encode(message, tones);
+  return JT9_SYMBOL_COUNT;
+}
+
+uint8_t encodeJt65(char *message, uint8_t *tones)
+{
+  jtencode.jt65_encode(message, tones);
+  return JT65_SYMBOL_COUNT;
+}
+
+uint8_t encodeJt4(char *message, uint8_t *tones)
+{
+  jtencode.jt4_encode(message, tones);
+  return JT4_SYMBOL_COUNT;
+}
+
+// Encode message in the given mode into tones. Modes with a station message send myCallsign,
+// myGridLocator and dBm instead. Returns the number of symbols, 0 if the mode has no encoder
+uint8_t encodeMessage(OperatingModes mode, char *message, uint8_t *tones)
+{
+  // Clear out the transmit buffer
+  memset(tones, 0, 255);
+
+  if (mode >= MODE_COUNT || !modeDescriptors[mode].encode)
+    return 0;
+  return modeDescriptors[mode].encode(message, tones);
+}
+
+void setTxBuffer()
+{
+  symbolCount = encodeMessage(operatingMode, txMessage, txBuffer);
+}
+
+// Map FT8/FT4 tones back to a codeword, run the LDPC parity and CRC checks and compare the
+// payload with message. Returns false if the tones must not be transmitted
+boolean verifyTones(OperatingModes mode, char *message, const uint8_t *tones)
+{
+  if (!txVerifyEnabled || (mode != MODE_FT8 && mode != MODE_FT4))
+    return true;
+
+  lastTxVerify = ft8.verify(message, tones, mode == MODE_FT4);
+  if (lastTxVerify == FTX_VERIFY_FREE_TEXT)
+  {
+    // valid tones, but pack77 did not recognise a standard message
+    Serial.printf("TX check: \"%s\" is sent as free text\n", message);
+    return true;
+  }
+  if (lastTxVerify != FTX_VERIFY_OK)
+  {
+    Serial.printf("TX check failed: %s, not transmitting\n", ftx_verify_text(lastTxVerify));
+    return false;
+  }
+  return true;
+}
+
+boolean verifyTxBuffer()
+{
+  return verifyTones(operatingMode, txMessage, txBuffer);
+}
+
+// Encodes that run ahead of a slot are spread over several task runs, so none of them holds up
+// the keyer or a symbol deadline for long. FT8 and FT4 pack the text in one step, compute
+// ENCODE_ROWS_PER_STEP of the 83 LDPC parity bits per step and check the tones in a last one.
+// JTEncode has no state to resume from, its modes are encoded and checked in a single step
+#define ENCODE_ROWS_PER_STEP 16
+
+struct EncodeJob
+{
+  OperatingModes mode;
+  char *message;   // read up to the last step
+  uint8_t *tones;  // 255 bytes, complete once the job is done
+  uint8_t count;   // symbols once done, 0 if the message can not be sent
+  boolean running; // steps remain
+  boolean encoded; // only the check is left
+  FT8Job ft8;
+};
+
+unsigned long encodeMaxStep = 0; // longest encode step in us
+
+void encodeJobBegin(EncodeJob &job, OperatingModes mode, char *message, uint8_t *tones)
+{
+  memset(tones, 0, 255);
+  job.mode = mode;
+  job.message = message;
+  job.tones = tones;
+  job.count = 0;
+  job.running = true;
+  job.encoded = false;
+  if (mode == MODE_FT8 || mode == MODE_FT4)
+    ft8.encodeBegin(&job.ft8, message, tones, mode == MODE_FT4);
+}
+
+// Run the next step of job. Returns true once it is done
+boolean encodeJobStep(EncodeJob &job)
+{
+  if (!job.running)
+    return true;
+
+  unsigned long start = micros();
+  if (job.mode != MODE_FT8 && job.mode != MODE_FT4)
+  {
+    job.count = encodeMessage(job.mode, job.message, job.tones);
+    job.running = false;
+  }
+  else if (!job.encoded)
+  {
+    job.encoded = ft8.encodeStep(&job.ft8, ENCODE_ROWS_PER_STEP);
+  }
+  else
+  {
+    job.count = job.mode == MODE_FT4 ? FT4_SYMBOL_COUNT : FT8_SYMBOL_COUNT;
+    job.running = false;
+  }
+  if (!job.running && job.count && !verifyTones(job.mode, job.message, job.tones))
+    job.count = 0;
+
+  if (micros() - start > encodeMaxStep)
+    encodeMaxStep = micros() - start;
+  return !job.running;
+}
+
+// Share of job that is done, 0..100. The check counts as the last percent
+uint8_t encodeJobProgress(const EncodeJob &job)
+{
+  if (!job.running)
+    return 100;
+  if (job.mode != MODE_FT8 && job.mode != MODE_FT4)
+    return 0;
+  if (job.encoded)
+    return 99;
+  int progress = ft8.encodeProgress(&job.ft8);
+  return progress > 98 ? 98 : progress;
+}
+
+// Encode message with a profile and start it on a channel at freq. Returns false if the channel
+// is busy, the profile is not sent by the tx engine or the tones fail their check
+boolean txStartMessage(uint8_t channel, uint8_t profile, uint64_t freq, char *message)
+{
+  Fraction spacing, period;
+  if (txChannelActive(channel) || channel >= TX_CHANNELS || !getModeTiming(profile, spacing, period))
+    return false;
+
+  OperatingModes mode = modeProfiles[profile].encoder;
+  // encode straight into the idle channel's tone buffer
+  uint8_t *tones = txChannels[channel].tones;
+  uint8_t count = encodeMessage(mode, message, tones);
+  if (!verifyTones(mode, message, tones))
+    return false;
+
+  return txStart(channel, mode, freq, tones, count, spacing, period, micros());
+}
+#pragma endregion JTEncode
+
+// Input events
+#pragma region InputEvents
+// The paddle, rotary and button ISRs only timestamp their edge and push it here. inputTask() is
+// the single consumer, so the ring needs no lock: the ISRs own inputHead and the task owns
+// inputTail. GPIO ISRs do not nest on the ESP8266, so the ISRs act as one producer.
+#define INPUT_RING_SIZE 32 // events, a power of two below 256
+
+enum InputEventTypes : uint8_t
+{
+  INPUT_DIT,    // value 1 pressed, 0 released
+  INPUT_DAH,    // value 1 pressed, 0 released
+  INPUT_ROTATE, // value +1 clockwise, -1 counterclockwise
+  INPUT_BUTTON, // value 1 pressed, 0 released
+};
+
+struct InputEvent
+{
+  unsigned long time; // micros() of the edge
+  InputEventTypes type;
+  int8_t value;
+};
+
+InputEvent inputRing[INPUT_RING_SIZE];
+volatile uint8_t inputHead = 0;         // next slot the ISRs write, free running
+volatile uint8_t inputTail = 0;         // next slot inputTask() reads, free running
+volatile unsigned long inputDropped = 0; // events lost to a full ring
+
+IRAM_ATTR void inputPush(InputEventTypes type, int8_t value)
+{
+  uint8_t head = inputHead;
+  if ((uint8_t)(head - inputTail) >= INPUT_RING_SIZE)
+  {
+    inputDropped++;
+    return;
+  }
+
+  InputEvent &event = inputRing[head % INPUT_RING_SIZE];
+  event.time = micros();
+  event.type = type;
+  event.value = value;
+  // the event must be complete before the consumer can see it
+  std::atomic_signal_fence(std::memory_order_release);
+  inputHead = head + 1;
+  taskWake(TASK_INPUT);
+}
+
+boolean inputPop(InputEvent &event)
+{
+  uint8_t tail = inputTail;
+  if (tail == inputHead)
+    return false;
+
+  std::atomic_signal_fence(std::memory_order_acquire);
+  event = inputRing[tail % INPUT_RING_SIZE];
+  inputTail = tail + 1;
+  return true;
+}
+#pragma endregion InputEvents
+
+// Morse and CW Keyer functionality
+#pragma region MorseAndCWKeyer
+boolean morseTxMsgSet = false;
+unsigned long previousMorseMilis = 0;
+
+// calculate timings in miliseconds based on the formula: T = 1200 / WPM
+int ditLength = 1200 / wpm;
+int dahLength = 1200 * 3 / wpm;
+
+// holds the current state of the paddles, kept by inputTask()
+boolean ditState;
+boolean dahState;
+
+// A press stays latched until the keyer has started its element, so a tap between two keyer
+// ticks is still sent
+boolean ditLatched = false;
+boolean dahLatched = false;
+
+boolean ditPressed()
+{
+  return ditState || ditLatched;
+}
+
+boolean dahPressed()
+{
+  return dahState || dahLatched;
+}
+
+// Morse keyer states
+enum MorseStates
+{
+  START,
+  DITSTATE,
+  DAHSTATE,
+  ENDCHAR,
+  ENDWORD,
+};
+MorseStates keyerState = START;
+
+// read dit state
+IRAM_ATTR void handleDitInterrupt()
+{
+  // Get the pin reading.
+  if (cwPaddlePinActiveLevel == ACTIVE_LOW)
+    inputPush(INPUT_DIT, !digitalRead(DIT_PIN));
+  else
+    inputPush(INPUT_DIT, !!digitalRead(DIT_PIN));
+}
+
+// read dah state
+IRAM_ATTR void handleDahInterrupt()
+{
+  // Get the pin reading.
+  if (cwPaddlePinActiveLevel == ACTIVE_LOW)
+    inputPush(INPUT_DAH, !digitalRead(DAH_PIN));
+  else
+    inputPush(INPUT_DAH, !!digitalRead(DAH_PIN));
+}
+
+// Turn output off
+void keyUp()
+{
+  noTone(BUZZER_PIN);
+
+  // CLK0 and PTT belong to the tx engine while channel 0 is on air, see keyDown()
+  if (txChannelActive(0))
+    return;
+
+  // PTT stays on while a beacon channel is on air
+  if (!txActive)
+    txSetPtt(false);
+
+  si5351.output_enable(SI5351_CLK0, 0);
+}
+// Turn output on
+void keyDown()
+{
+  // Keying is refused while a channel 0 transmission drives CLK0
+  if (txChannelActive(0))
+    return;
+
+  if (pttPinActiveLevel == ACTIVE_LOW)
+    digitalWrite(PTT_PIN, LOW);
+  else
+    digitalWrite(PTT_PIN, HIGH);
+
+  tone(BUZZER_PIN, 1000);
+  si5351.output_enable(SI5351_CLK0, 1);
+}
+
+// state variables for CW
+boolean sendingDit = false;
+boolean completedDit = false;
+unsigned long lastDitTriggerd = 0;
+
+boolean sendingDah = false;
+boolean completedDah = false;
+unsigned long lastDahTriggerd = 0;
+
+boolean keyerIdle = false;
+unsigned long lastKeyerIdleTriggered = 0;
+
+boolean nextKeyerStateSet = false;
+MorseStates nextKeyerState;
+#pragma endregion MorseAndCWKeyer
+
+// Rotary Encoder logic
+#pragma region RotaryEncoder
+// The encoder tunes the frequency. Detents that come quickly move it in bigger steps, and all
+// detents within a frame are applied with a single set_freq
+#define TUNE_FRAME_US 20000UL  // shortest time between two frequency updates
+#define TUNE_FAST_US 15000UL   // detents closer than this step TUNE_FAST_HZ
+#define TUNE_MEDIUM_US 50000UL // detents closer than this step TUNE_MEDIUM_HZ
+#define TUNE_SLOW_HZ 10
+#define TUNE_MEDIUM_HZ 100
+#define TUNE_FAST_HZ 1000
+
+IRAM_ATTR void handleRotate()
+{
+  unsigned char result = rotary.process();
+  if (result == DIR_CW)
+    inputPush(INPUT_ROTATE, 1);
+  else if (result == DIR_CCW)
+    inputPush(INPUT_ROTATE, -1);
+}
+
+IRAM_ATTR void handleRotarySwitchPress()
+{
+  // Get the pin reading.
+  if (rotaryButtonActiveLevel == ACTIVE_LOW)
+    inputPush(INPUT_BUTTON, !digitalRead(ROTARY_SW_PIN));
+  else
+    inputPush(INPUT_BUTTON, !!digitalRead(ROTARY_SW_PIN));
+}
+
+boolean rotaryButtonDown = false;     // filters out repeated press edges of a bouncing switch
+unsigned long lastDetentTime = 0;     // micros() of the previous detent
+int64_t tunePending = 0;              // tuning not yet applied, in 0.01 Hz
+unsigned long lastTuneTime = 0;       // micros() of the last frequency update
+unsigned long tuneUpdates = 0;        // frequency updates
+unsigned long tuneDetents = 0;        // detents they were made of
+
+// Tuning step of a detent that follows the previous one after interval us, in Hz
+uint32_t tuneStep(unsigned long interval)
+{
+  if (interval < TUNE_FAST_US)
+    return TUNE_FAST_HZ;
+  if (interval < TUNE_MEDIUM_US)
+    return TUNE_MEDIUM_HZ;
+  return TUNE_SLOW_HZ;
+}
+
+// Apply the pending tuning to frequency. While a message is on air the new frequency is used
+// for the next one
+void tuneApply()
+{
+  int64_t tuned = (int64_t)frequency + tunePending;
+  if (tuned < (int64_t)(SI5351_CLKOUT_MIN_FREQ * SI5351_FREQ_MULT))
+    tuned = SI5351_CLKOUT_MIN_FREQ * SI5351_FREQ_MULT;
+  if (tuned > (int64_t)(SI5351_CLKOUT_MAX_FREQ * SI5351_FREQ_MULT))
+    tuned = SI5351_CLKOUT_MAX_FREQ * SI5351_FREQ_MULT;
+  frequency = tuned;
+  tunePending = 0;
+  lastTuneTime = micros();
+  tuneUpdates++;
+
+  if (!txChannelActive(0))
+    si5351.set_freq(frequency, SI5351_CLK0);
+  taskWake(TASK_DISPLAY);
+}
+#pragma endregion RotaryEncoder
+
+// WSJTX UDP
+#pragma region WSJTX
+const unsigned int localUdpPort = 2237; // local port to listen on
+uint8_t WSJTX_incomingByteArray[255];   // buffer for incoming packets
+size_t WSJTX_currentIndex = 0;
+
+// WSJTX helper functions
+uint8 readuInt8()
+{
+  uint8 val;
+  memcpy(&val, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(val));
+  WSJTX_currentIndex += 1;
+  return val;
+}
+
+uint32 readuInt32()
+{
+  uint32 bigEndianValue;
+  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
+  WSJTX_currentIndex += 4;
+  uint32 theUnpackedValue = ntohl(bigEndianValue);
+  return theUnpackedValue;
+}
+
+int32 readInt32()
+{
+  int32 bigEndianValue;
+  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
+  WSJTX_currentIndex += 4;
+  int32 theUnpackedValue = ntohl(bigEndianValue);
+  return theUnpackedValue;
+}
+
+uint64 readuInt64()
+{
+  uint64 bigEndianValue;
+  memcpy(&bigEndianValue, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(bigEndianValue));
+  WSJTX_currentIndex += 8;
+  uint64 theUnpackedValue = __builtin_bswap64(bigEndianValue);
+  return theUnpackedValue;
+}
+
+bool readBool()
+{
+  bool val;
+  memcpy(&val, &WSJTX_incomingByteArray[WSJTX_currentIndex], sizeof(val));
+  WSJTX_currentIndex += 1;
+  return val;
+}
+
+// Slot synchronised TX
+// The tones are encoded and checked as soon as the message is known (wsjtxArm), so a start only
+// costs the register writes. A start is pinned to the slot boundary plus the mode's start offset
+// on the NTP clock. If it happens late, txStart() skips the symbols that are already over and the
+// message still ends in its slot. The Transmitting edge from WSJT-X starts TX and tells which
+// slots WSJT-X transmits in. Modes that alternate slots are then started on the boundary itself,
+// ahead of the status packet; TX is stopped again if WSJT-X does not report Transmitting in time.
+// Without a clock, TX starts on the Transmitting edge as before.
+#define NTP_VALID_EPOCH 1600000000L // the clock counts as set once it is past September 2020
+#define WSJTX_CONFIRM_MS 2000       // time WSJT-X has to confirm a start made on the slot boundary
+#define WSJTX_HALT_GUARD_MS 500     // Transmitting dropping this close to the end of our message is not a halt
+
+boolean wsjtxTransmitting = false;      // Transmitting flag of the last status packet
+boolean txArmed = false;                // txBuffer holds the checked tones of txArmedKey
+OperatingModes txArmedMode;             // mode of the armed tones
+char txArmedKey[100];                   // message the armed tones carry (WSPR: call, grid and power)
+int8_t wsjtxTxParity = -1;              // parity of the slots WSJT-X transmits in, -1 when unknown
+uint32_t wsjtxStartedSlot = UINT32_MAX; // slot of the last start
+boolean wsjtxStartPending = false;      // a start is scheduled
+boolean wsjtxStartPredicted = false;    // the scheduled start was made ahead of the Transmitting edge
+unsigned long wsjtxStartTime = 0;       // micros() at which symbol 0 of the scheduled start is due
+uint32_t wsjtxStartSlot = UINT32_MAX;   // slot of the scheduled start
+boolean wsjtxUnconfirmed = false;       // started on the boundary, WSJT-X has not reported Transmitting yet
+unsigned long wsjtxConfirmBy = 0;       // millis() by which WSJT-X has to report Transmitting
+
+// Index and micros() at the start of the current slot of slotMs.
+// Returns false while the clock is not set
+boolean getSlot(uint32_t slotMs, uint32_t &index, unsigned long &start)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  unsigned long t = micros();
+  if (tv.tv_sec < NTP_VALID_EPOCH)
+    return false;
+
+  uint64_t nowUs = (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+  uint64_t slotUs = (uint64_t)slotMs * 1000ULL;
+  index = (uint32_t)(nowUs / slotUs);
+  start = t - (unsigned long)(nowUs % slotUs);
+  return true;
+}
+
+EncodeJob wsjtxArmJob; // encode of txArmedKey into txBuffer
+
+// Encode and check the tones of the current message ahead of the slot. The encode runs in steps
+// from wsjtxTask(). Does nothing while the armed tones are still current or being encoded
+void wsjtxArm()
+{
+  char key[100];
+  if (modeDescriptors[operatingMode].stationMessage)
+    snprintf(key, sizeof(key), "%s %s %u", myCallsign, myGridLocator, dBm);
+  else
+    strcpy(key, txMessage);
+
+  if ((txArmed || wsjtxArmJob.running) && txArmedMode == operatingMode && strcmp(key, txArmedKey) == 0)
+    return;
+
+  // txBuffer is copied when TX starts, so it can be rearmed while a message is on air
+  txArmed = false;
+  txArmedMode = operatingMode;
+  strcpy(txArmedKey, key);
+  encodeJobBegin(wsjtxArmJob, operatingMode, txMessage, txBuffer);
+  taskWake(TASK_WSJTX);
+}
+
+// Run the next step of the arm encode. Returns true while steps remain
+boolean wsjtxArmStep()
+{
+  if (!wsjtxArmJob.running)
+    return false;
+
+  if (encodeJobStep(wsjtxArmJob))
+  {
+    symbolCount = wsjtxArmJob.count;
+    txArmed = symbolCount != 0;
+  }
+  return wsjtxArmJob.running;
+}
+
+// Schedule a start at the boundary of the current slot plus the mode's start offset.
+// Without a clock the start is right away
+void wsjtxScheduleStart(boolean predicted)
+{
+  uint32_t slotMs, offsetMs, index;
+  unsigned long start;
+  if (getModeSlot(modeProfile, slotMs, offsetMs) && getSlot(slotMs, index, start))
+  {
+    if (index == wsjtxStartedSlot)
+      return;
+
+    wsjtxStartTime = start + offsetMs * 1000UL;
+    wsjtxStartSlot = index;
+  }
+  else
+  {
+    wsjtxStartTime = micros();
+    wsjtxStartSlot = UINT32_MAX;
+  }
+  wsjtxStartPending = true;
+  wsjtxStartPredicted = predicted;
+}
+
+// Handle the Transmitting flag of a status packet received at micros() == receiveTime
+void wsjtxTransmittingUpdate(boolean transmitting, unsigned long receiveTime)
+{
+  // Halt Tx. The flag also drops when WSJT-X finishes a message, which may be a little ahead of ours
+  if (!transmitting && wsjtxTransmitting)
+  {
+    wsjtxStartPending = false;
+    if (txTimeToEnd(0) > WSJTX_HALT_GUARD_MS * 1000UL)
+      txRequestAbort(1 << 0, receiveTime);
+  }
+
+  if (transmitting && !wsjtxTransmitting)
+  {
+    wsjtxUnconfirmed = false;
+
+    // WSJT-X alternates slots, remember which ones it transmits in
+    uint32_t slotMs, offsetMs, index;
+    unsigned long start;
+    if (getModeSlot(modeProfile, slotMs, offsetMs) && getSlot(slotMs, index, start))
+      wsjtxTxParity = index % 2;
+
+    if (txEnabled && txArmed && !txChannelActive(0) && !wsjtxStartPending)
+      wsjtxScheduleStart(false);
+  }
+  wsjtxTransmitting = transmitting;
+}
+
+// Start scheduled and predicted transmissions when they are due. Polled from loop() in WSJT-X mode
+void wsjtxSlotUpdate()
+{
+  // a start on the boundary that WSJT-X did not follow
+  if (wsjtxUnconfirmed && (long)(millis() - wsjtxConfirmBy) >= 0)
+  {
+    wsjtxUnconfirmed = false;
+    wsjtxTxParity = -1;
+    if (txChannelActive(0))
+      txStop(txChannels[0]);
+    Serial.printf("WSJT-X did not confirm TX, stopped\n");
+  }
+
+  if (!txEnabled || !txArmed || txChannelActive(0))
+  {
+    wsjtxStartPending = false;
+    return;
+  }
+
+  // WSPR picks its slots at random, the other modes alternate
+  uint32_t slotMs, offsetMs, index;
+  unsigned long start;
+  if (!wsjtxStartPending && wsjtxTxParity >= 0 && operatingMode != MODE_WSPR &&
+      getModeSlot(modeProfile, slotMs, offsetMs) && getSlot(slotMs, index, start) &&
+      (int8_t)(index % 2) == wsjtxTxParity && index != wsjtxStartedSlot)
+    wsjtxScheduleStart(true);
+
+  if (wsjtxStartPending && (long)(micros() - wsjtxStartTime) >= 0)
+  {
+    wsjtxStartPending = false;
+    wsjtxStartedSlot = wsjtxStartSlot;
+    if (jtTransmitMessage(wsjtxStartTime) && wsjtxStartPredicted && !wsjtxTransmitting)
+    {
+      wsjtxUnconfirmed = true;
+      wsjtxConfirmBy = millis() + WSJTX_CONFIRM_MS;
+    }
+  }
+}
+
+#pragma endregion WSJTX
+
+// Transmit queue
+#pragma region TxQueue
+// Messages and raw tone sequences for channel 0 wait here in order. The head entry is encoded
+// into txQueueTones as soon as it is at the head, normally while the message before it is still
+// on air, so it can start right on its slot. The encode runs one step per txQueueTask() run: txStart() copies the tones into the channel and the
+// staging buffer is free for the next entry. An entry either names the slot it must go out in
+// or takes the first slot that is free
+#define TX_QUEUE_SIZE 4            // entries
+#define TX_QUEUE_POLL_US 1000000UL // longest wait before a start time is worked out again
+#define TX_QUEUE_LATE_US 1000000UL // an entry for a given slot may start this late, joining mid message
+
+struct TxQueueEntry
+{
+  OperatingModes mode; // encoder, MODE_RAW for tones that came encoded
+  uint64_t frequency;
+  Fraction spacing;
+  Fraction period;
+  uint32_t slotMs;   // slot length, 0 to start as soon as channel 0 is free
+  uint32_t offsetMs; // start within the slot
+  uint32_t slot;     // slot index since the epoch to start in, 0 for the first free one
+  uint8_t count;     // tones of a MODE_RAW entry
+  uint8_t data[255]; // message as a C string, or the tones of a MODE_RAW entry
+};
+
+TxQueueEntry txQueue[TX_QUEUE_SIZE];
+uint8_t txQueueHead = 0;  // oldest entry
+uint8_t txQueueCount = 0; // entries waiting
+
+uint8_t txQueueTones[255];          // tones of the head entry once txQueueEncoded
+uint8_t txQueueSymbols = 0;         // symbols in txQueueTones
+boolean txQueueEncoded = false;     // the head entry is ready to start
+EncodeJob txQueueJob;               // encode of the head entry
+unsigned long txQueueEncodeStart;   // micros() of the first step of txQueueJob
+unsigned long txQueueStarted = 0;   // entries that went on air
+unsigned long txQueueDropped = 0;   // entries that failed to encode or missed their slot
+unsigned long txQueueMaxEncode = 0; // longest encode from first to last step in us
+
+// Slot to append to, NULL if the queue is full
+TxQueueEntry *txQueueSlot()
+{
+  if (txQueueCount >= TX_QUEUE_SIZE)
+    return NULL;
+  return &txQueue[(txQueueHead + txQueueCount) % TX_QUEUE_SIZE];
+}
+
+void txQueueAppend()
+{
+  txQueueCount++;
+  taskWake(TASK_TXQUEUE);
+}
+
+// Queue message in a profile. slot 0 takes the first free slot of the profile.
+// Returns false if the queue is full or the profile is not sent by the tx engine
+boolean txQueueMessage(uint8_t profile, uint64_t freq, const char *message, uint32_t slot)
+{
+  TxQueueEntry *e = txQueueSlot();
+  if (e == NULL || !getModeTiming(profile, e->spacing, e->period))
+    return false;
+
+  e->mode = modeProfiles[profile].encoder;
+  e->frequency = freq;
+  if (!getModeSlot(profile, e->slotMs, e->offsetMs))
+    e->slotMs = e->offsetMs = 0;
+  e->slot = slot;
+  strncpy((char *)e->data, message, sizeof(txMessage) - 1);
+  e->data[sizeof(txMessage) - 1] = 0;
+  txQueueAppend();
+  return true;
+}
+
+// Queue count tones, they start as soon as channel 0 is free
+boolean txQueueTonesRaw(uint64_t freq, const uint8_t *tones, uint8_t count, Fraction spacing, Fraction period)
+{
+  TxQueueEntry *e = txQueueSlot();
+  if (e == NULL || count == 0)
+    return false;
+
+  e->mode = MODE_RAW;
+  e->frequency = freq;
+  e->spacing = spacing;
+  e->period = period;
+  e->slotMs = e->offsetMs = e->slot = 0;
+  e->count = count;
+  memcpy(e->data, tones, count);
+  txQueueAppend();
+  return true;
+}
+
+void txQueueClear()
+{
+  txQueueCount = 0;
+  txQueueEncoded = false;
+  txQueueJob.running = false;
+}
+
+void txQueuePop()
+{
+  txQueueHead = (txQueueHead + 1) % TX_QUEUE_SIZE;
+  txQueueCount--;
+  txQueueEncoded = false;
+  txQueueJob.running = false;
+}
+
+// Run the next step of the encode of the head entry into txQueueTones. Returns true once
+// txQueueSymbols is set, it is 0 if the entry can not be sent
+boolean txQueueEncodeStep(TxQueueEntry &e)
+{
+  if (e.mode == MODE_RAW)
+  {
+    memcpy(txQueueTones, e.data, e.count);
+    txQueueSymbols = e.count;
+    return true;
+  }
+
+  if (!txQueueJob.running)
+  {
+    encodeJobBegin(txQueueJob, e.mode, (char *)e.data, txQueueTones);
+    txQueueEncodeStart = micros();
+  }
+  if (!encodeJobStep(txQueueJob))
+    return false;
+
+  txQueueSymbols = txQueueJob.count;
+  if (micros() - txQueueEncodeStart > txQueueMaxEncode)
+    txQueueMaxEncode = micros() - txQueueEncodeStart;
+  return true;
+}
+
+// Time in us from now until the head entry is due, after channel 0 has finished. Returns false
+// if an entry for a given slot can not make it any more. A stream on channel 0 is taken to end
+// with its buffered tones, see txTimeToEnd()
+boolean txQueueStartIn(const TxQueueEntry &e, int64_t &startIn)
+{
+  unsigned long freeIn = txTimeToEnd(0);
+  uint32_t index;
+  unsigned long slotStart;
+  unsigned long t = micros();
+  if (e.slotMs == 0 || !getSlot(e.slotMs, index, slotStart))
+  {
+    // no slots, or no clock to find them
+    startIn = freeIn;
+    return true;
+  }
+
+  int64_t slotUs = (int64_t)e.slotMs * 1000;
+  startIn = -(int64_t)(t - slotStart) + (int64_t)e.offsetMs * 1000;
+  if (e.slot)
+  {
+    startIn += ((int64_t)e.slot - index) * slotUs;
+    return freeIn ? startIn >= (int64_t)freeIn : startIn >= -(int64_t)TX_QUEUE_LATE_US;
+  }
+
+  while (startIn < (int64_t)freeIn)
+    startIn += slotUs;
+  return true;
+}
+
+unsigned long txQueueTask()
+{
+  if (txQueueCount == 0)
+    return TASK_SLEEP;
+
+  TxQueueEntry &e = txQueue[txQueueHead];
+  if (!txQueueEncoded)
+  {
+    // one step per run, the keyer and the symbol deadlines get their turn in between
+    if (!txQueueEncodeStep(e))
+      return 0;
+    if (txQueueSymbols == 0)
+    {
+      Serial.printf("TX queue: entry can not be encoded, dropped\n");
+      txQueueDropped++;
+      txQueuePop();
+      return 0;
+    }
+    txQueueEncoded = true;
+  }
+
+  int64_t startIn;
+  if (!txQueueStartIn(e, startIn))
+  {
+    Serial.printf("TX queue: slot %u missed, dropped\n", e.slot);
+    txQueueDropped++;
+    txQueuePop();
+    return 0;
+  }
+  if (startIn > 0)
+    return startIn < (int64_t)TX_QUEUE_POLL_US ? (unsigned long)startIn : TX_QUEUE_POLL_US;
+
+  // due, channel 0 taken by something else: look for the next slot once it is free
+  if (txChannelActive(0))
+  {
+    unsigned long freeIn = txTimeToEnd(0);
+    return freeIn < TX_QUEUE_POLL_US ? freeIn : TX_QUEUE_POLL_US;
+  }
+
+  if (txStart(0, e.mode, e.frequency, txQueueTones, txQueueSymbols, e.spacing, e.period, micros() + (long)startIn))
+    txQueueStarted++;
+  else
+    txQueueDropped++;
+  txQueuePop();
+  return 0;
+}
+#pragma endregion TxQueue
+
+// Raw tone frames
+#pragma region ToneFrames
+// Tones generated on a host (see lib/ToneFrame) are unpacked straight into the tone buffer of
+// the idle channel the frame names and played by the tx engine. A frame comes as the body of a
+// POST to /tones, or as one UDP datagram to toneUdpPort which is answered with a single
+// tone_frame_result_t byte. Stream frames only come over UDP, they go to the jitter buffer
+// (txStream) and are not answered
+const unsigned int toneUdpPort = 2238;
+
+// Parse state of one POST /tones. It lives in the request's _tempObject, which the web server
+// frees with the request, so uploads that overlap never mix their frames
+struct HttpToneUpload
+{
+  tone_frame_t frame;                  // header of the frame
+  tone_frame_result_t result;          // state of the frame
+  uint8_t tones[TONE_FRAME_MAX_TONES]; // tones of the frame
+};
+
+// Check a parsed frame of frameLen bytes against the transmitter and clear the tone buffer
+// of its channel
+tone_frame_result_t toneFrameAccept(const tone_frame_t &frame, size_t frameLen)
+{
+  if (frame.type != TONE_FRAME_TYPE_MESSAGE)
+    return TONE_FRAME_BAD_TYPE;
+  if (frameLen != TONE_FRAME_HEADER_LEN + tone_frame_payload_len(&frame))
+    return TONE_FRAME_SHORT;
+  if (frame.channel >= TX_CHANNELS || txChannelActive(frame.channel))
+    return TONE_FRAME_REJECTED;
+
+  return TONE_FRAME_OK;
+}
+
+// Start a frame whose tones have been unpacked into its channel
+tone_frame_result_t toneFrameStart(const tone_frame_t &frame)
+{
+  Fraction spacing = {frame.spacing_mhz, 1000};
+  Fraction period = {frame.period_us, 1000000};
+  if (!txStart(frame.channel, MODE_RAW, frame.frequency, txChannels[frame.channel].tones, frame.count, spacing, period, micros()))
+    return TONE_FRAME_REJECTED;
+  return TONE_FRAME_OK;
+}
+
+// Body handler of POST /tones, called for every received chunk of the body
+void toneFrameBody(AsyncWebServerRequest *request, const uint8_t *data, size_t len, size_t index, size_t total)
+{
+  HttpToneUpload *upload = static_cast<HttpToneUpload *>(request->_tempObject);
+  if (index == 0 && upload == NULL)
+  {
+    upload = static_cast<HttpToneUpload *>(malloc(sizeof(HttpToneUpload)));
+    if (upload == NULL)
+      return;
+    request->_tempObject = upload;
+    upload->result = tone_frame_parse(data, len, &upload->frame);
+    if (upload->result == TONE_FRAME_OK)
+      upload->result = toneFrameAccept(upload->frame, total);
+    memset(upload->tones, 0, sizeof(upload->tones));
+  }
+  if (upload == NULL || upload->result != TONE_FRAME_OK || index + len <= TONE_FRAME_HEADER_LEN)
+    return;
+
+  size_t skip = (index < TONE_FRAME_HEADER_LEN) ? TONE_FRAME_HEADER_LEN - index : 0;
+  tone_frame_unpack(&upload->frame, data + skip, len - skip, index + skip - TONE_FRAME_HEADER_LEN,
+                    upload->tones);
+}
+
+// Add the tones of a stream frame to the jitter buffer. The first frame of a stream opens it
+// with its channel and parameters, playback starts once the prefill is buffered
+void toneStreamFrame(const tone_frame_t &frame, const uint8_t *tones)
+{
+  // An open stream that never got going is dropped once it times out
+  boolean live = txStream.open && (txChannelActive(txStream.channel) || micros() - txStream.lastFrame < TX_STREAM_TIMEOUT_US);
+  if (!live)
+  {
+    if (frame.count == 0 || frame.channel >= TX_CHANNELS || txChannelActive(frame.channel) ||
+        (1 << frame.bits) - 1 > TX_STREAM_MAX_TONE)
+      return;
+
+    txStream.open = true;
+    txStream.ending = false;
+    txStream.channel = frame.channel;
+    txStream.frequency = frame.frequency;
+    txStream.spacing = {frame.spacing_mhz, 1000};
+    txStream.period = {frame.period_us, 1000000};
+    txStream.maxTone = (1 << frame.bits) - 1;
+    txStream.prefill = TX_STREAM_PREFILL_US / frame.period_us + 1;
+    if (txStream.prefill > TX_STREAM_SIZE / 2)
+      txStream.prefill = TX_STREAM_SIZE / 2;
+    txStream.next = frame.first;
+    txStream.head = frame.first;
+    memset(txStream.present, 0, sizeof(txStream.present));
+  }
+  else if (frame.channel != txStream.channel)
+  {
+    return;
+  }
+
+  txStream.frames++;
+  txStream.lastFrame = micros();
+  if (frame.count == 0)
+    txStream.ending = true;
+
+  boolean late = false;
+  for (uint8_t i = 0; i < frame.count; i++)
+  {
+    uint32_t index = frame.first + i;
+    if (index < txStream.next)
+    {
+      late = true;
+      continue;
+    }
+    if (index - txStream.next >= TX_STREAM_SIZE || tones[i] > txStream.maxTone)
+    {
+      txStream.overruns++;
+      continue;
+    }
+
+    uint16_t slot = index % TX_STREAM_SIZE;
+    txStream.tones[slot] = tones[i];
+    txStream.present[slot / 8] |= (1 << (slot % 8));
+    if (index >= txStream.head)
+      txStream.head = index + 1;
+  }
+  if (late)
+    txStream.lateFrames++;
+
+  if (!txChannelActive(txStream.channel) && (txStream.head - txStream.next >= txStream.prefill || txStream.ending))
+  {
+    if (txStream.head == txStream.next || !txStartStream())
+      txStream.open = false;
+  }
+}
+
+// Unpack the packed tones of a datagram whose header has been read
+void toneUdpReadTones(const tone_frame_t &frame, uint8_t *tones)
+{
+  if (frame.bits == 8)
+  {
+    // one byte per tone, read straight into the tone buffer
+    toneUdp.read(tones, frame.count);
+    return;
+  }
+
+  uint8_t chunk[32];
+  size_t offset = 0;
+  int n;
+  while ((n = toneUdp.read(chunk, sizeof(chunk))) > 0)
+  {
+    tone_frame_unpack(&frame, chunk, n, offset, tones);
+    offset += n;
+  }
+}
+
+// Receive a frame datagram. Polled from loop()
+void toneUdpUpdate()
+{
+  int size = toneUdp.parsePacket();
+  if (!size)
+    return;
+
+  uint8_t header[TONE_FRAME_STREAM_HEADER_LEN];
+  int headerLen = toneUdp.read(header, TONE_FRAME_HEADER_LEN);
+  if (headerLen == TONE_FRAME_HEADER_LEN && header[2] == TONE_FRAME_TYPE_STREAM)
+    headerLen += toneUdp.read(&header[TONE_FRAME_HEADER_LEN], TONE_FRAME_STREAM_HEADER_LEN - TONE_FRAME_HEADER_LEN);
+
+  tone_frame_t frame;
+  tone_frame_result_t result = TONE_FRAME_SHORT;
+  if (headerLen > 0)
+    result = tone_frame_parse(header, headerLen, &frame);
+
+  if (result == TONE_FRAME_OK && frame.type == TONE_FRAME_TYPE_STREAM)
+  {
+    if ((size_t)size == TONE_FRAME_STREAM_HEADER_LEN + tone_frame_payload_len(&frame))
+    {
+      uint8_t tones[TONE_FRAME_MAX_TONES] = {0};
+      toneUdpReadTones(frame, tones);
+      toneStreamFrame(frame, tones);
+    }
+    return;
+  }
+
+  if (result == TONE_FRAME_OK)
+    result = toneFrameAccept(frame, size);
+  if (result == TONE_FRAME_OK)
+  {
+    memset(txChannels[frame.channel].tones, 0, TONE_FRAME_MAX_TONES);
+    toneUdpReadTones(frame, txChannels[frame.channel].tones);
+    result = toneFrameStart(frame);
+  }
+
+  toneUdp.beginPacket(toneUdp.remoteIP(), toneUdp.remotePort());
+  toneUdp.write((uint8_t)result);
+  toneUdp.endPacket();
+}
+#pragma endregion ToneFrames
+
+// Command mailbox
+#pragma region Commands
+// Web handlers run in the TCP callback context. They never touch the device state or the I2C
+// bus: each request becomes a Command in a single-producer/single-consumer ring and commandTask()
+// applies it from loop(), between symbols. The reply only confirms that the command was queued
+#define COMMAND_QUEUE_SIZE 4 // commands, a power of two below 256
+
+enum CommandTypes : uint8_t
+{
+  CMD_SET,           // /set, key and value
+  CMD_CHANNEL_START, // /chan, channel, profile, frequency and message
+  CMD_CHANNEL_STOP,  // /chan with txEn=false, channel
+  CMD_TONES,         // POST /tones, frame header and tones
+  CMD_QUEUE,         // /queue, profile, frequency, message and slot
+  CMD_QUEUE_TONES,   // POST /tones?queue, frame header and tones
+  CMD_QUEUE_CLEAR,   // /queue?clear
+};
+
+// Keys of /set, in the order of setKeyNames
+enum SetKeys : uint8_t
+{
+  SET_FREQ,
+  SET_OPMODE,
+  SET_TXMSG,
+  SET_TXEN,
+  SET_WPM,
+  SET_MYCALL,
+  SET_DXCALL,
+  SET_MYGRID,
+  SET_CAL,
+  SET_TXVERIFY,
+  SET_KEY_COUNT
+};
+
+const char *const setKeyNames[SET_KEY_COUNT] = {
+    "freq", "opMode", "txMsg", "txEn", "wpm", "myCall", "dxCall", "myGrid", "cal", "txVerify"};
+
+struct Command
+{
+  CommandTypes type;
+  SetKeys key;                        // CMD_SET
+  uint8_t channel;                    // CMD_CHANNEL_START, CMD_CHANNEL_STOP
+  uint8_t profile;                    // CMD_CHANNEL_START, CMD_QUEUE
+  uint64_t frequency;                 // CMD_CHANNEL_START, CMD_QUEUE
+  uint32_t slot;                      // CMD_QUEUE
+  tone_frame_t frame;                 // CMD_TONES, CMD_QUEUE_TONES
+  uint8_t data[TONE_FRAME_MAX_TONES]; // value or message as a C string, or the tones of CMD_TONES
+};
+
+void statePublish();
+
+Command commandQueue[COMMAND_QUEUE_SIZE];
+volatile uint8_t commandHead = 0; // next slot the web handlers fill, free running
+volatile uint8_t commandTail = 0; // next slot commandTask() applies, free running
+unsigned long commandsApplied = 0;
+unsigned long commandsRejected = 0; // commands dropped because the queue was full
+
+// Slot for the next command, NULL if the queue is full. Publish it with commandPush()
+Command *commandSlot()
+{
+  if ((uint8_t)(commandHead - commandTail) >= COMMAND_QUEUE_SIZE)
+  {
+    commandsRejected++;
+    return NULL;
+  }
+  return &commandQueue[commandHead % COMMAND_QUEUE_SIZE];
+}
+
+void commandPush()
+{
+  // the command must be complete before commandTask() can see it
+  std::atomic_signal_fence(std::memory_order_release);
+  commandHead = commandHead + 1;
+  taskWake(TASK_COMMANDS);
+}
+
+// Key of /set called name, SET_KEY_COUNT if there is none
+SetKeys findSetKey(const char *name)
+{
+  uint8_t k = 0;
+  while (k < SET_KEY_COUNT && strcmp(name, setKeyNames[k]) != 0)
+    k++;
+  return static_cast<SetKeys>(k);
+}
+
+// Queue a /set command. Returns false if the queue is full
+boolean commandSet(SetKeys key, const char *value)
+{
+  Command *command = commandSlot();
+  if (command == NULL)
+    return false;
+
+  command->type = CMD_SET;
+  command->key = key;
+  strncpy((char *)command->data, value, sizeof(txMessage) - 1);
+  command->data[sizeof(txMessage) - 1] = 0;
+  commandPush();
+  return true;
+}
+
+void commandApplySet(SetKeys key, const char *value)
+{
+  switch (key)
+  {
+  case SET_FREQ:
+    setFrequency(value);
+    break;
+  case SET_OPMODE:
+    setOperatingMode(value);
+    break;
+  case SET_TXMSG:
+    setTxMessage(value);
+    break;
+  case SET_TXEN:
+    setTxEnabled(value);
+    break;
+  case SET_WPM:
+    setMorseWPM(value);
+    break;
+  case SET_MYCALL:
+    setMyCallsign(value);
+    break;
+  case SET_DXCALL:
+    setDxCallsign(value);
+    break;
+  case SET_MYGRID:
+    setMyGrid(value);
+    break;
+  case SET_CAL:
+    setCalibration(value);
+    break;
+  case SET_TXVERIFY:
+    setTxVerify(value);
+    break;
+  default:
+    break;
+  }
+}
+
+// Apply the queued commands and publish the new state
+unsigned long commandTask()
+{
+  while (commandTail != commandHead)
+  {
+    std::atomic_signal_fence(std::memory_order_acquire);
+    Command &command = commandQueue[commandTail % COMMAND_QUEUE_SIZE];
+    char *text = (char *)command.data;
+    switch (command.type)
+    {
+    case CMD_SET:
+      commandApplySet(command.key, text);
+      taskWake(TASK_DISPLAY);
+      break;
+
+    case CMD_CHANNEL_START:
+      if (!text[0])
+        strcpy(text, txMessage);
+      if (!txStartMessage(command.channel, command.profile, command.frequency, text))
+        Serial.printf("Channel %u busy or mode not supported\n", command.channel);
+      break;
+
+    case CMD_CHANNEL_STOP:
+      if (txChannelActive(command.channel))
+        txStop(txChannels[command.channel]);
+      break;
+
+    case CMD_TONES:
+      if (txChannelActive(command.frame.channel))
+      {
+        Serial.printf("Tones: channel %u busy\n", command.frame.channel);
+        break;
+      }
+      memcpy(txChannels[command.frame.channel].tones, command.data, TONE_FRAME_MAX_TONES);
+      Serial.printf("Tones: %s\n", tone_frame_text(toneFrameStart(command.frame)));
+      break;
+
+    case CMD_QUEUE:
+      if (!text[0])
+        strcpy(text, txMessage);
+      if (!txQueueMessage(command.profile, command.frequency, text, command.slot))
+        Serial.printf("TX queue full or mode not supported\n");
+      break;
+
+    case CMD_QUEUE_TONES:
+      if (!txQueueTonesRaw(command.frame.frequency, command.data, command.frame.count,
+                           {command.frame.spacing_mhz, 1000}, {command.frame.period_us, 1000000}))
+        Serial.printf("TX queue full\n");
+      break;
+
+    case CMD_QUEUE_CLEAR:
+      txQueueClear();
+      break;
+    }
+    commandTail = commandTail + 1;
+    commandsApplied++;
+  }
+
+  statePublish();
+  return TASK_SLEEP;
+}
+#pragma endregion Commands
+
+// Boot stages
+#pragma region Boot
+// setup() only brings up what the keyer and the tx engine need, so standalone operation is ready
+// a few ms after power on. LittleFS is mounted once the radio is up, without formatting a flash
+// that does not mount, and the mode profiles and the WiFi cache are read from it. The display is initialised by the first displayTask() run and the
+// network comes up in the background from netTask(). A connect attempt to the access point and
+// channel of the last connection skips the scan; if it fails, the next attempt scans. Failed
+// attempts are retried with a pause that doubles up to WIFI_RETRY_MAX_MS. The web server and
+// the UDP listeners start with the first connection
+#define WIFI_CACHE_FILE "/wifi.bin"   // access point and channel of the last connection on LittleFS
+#define WIFI_CACHE_MAGIC 0x57494649UL // "WIFI", tells a cache file from garbage
+#define WIFI_CONNECT_TIMEOUT_MS 10000 // an attempt that has not connected by then has failed
+#define WIFI_RETRY_MIN_MS 1000        // pause after the first failed attempt
+#define WIFI_RETRY_MAX_MS 60000       // longest pause between attempts
+
+enum BootStages : uint8_t
+{
+  BOOT_IO,      // pins, interrupts and Si5351: keyer and tx engine ready
+  BOOT_STORAGE, // LittleFS mounted (if it can be), mode profiles and WiFi cache read
+  BOOT_DISPLAY, // display initialised
+  BOOT_NETWORK, // WiFi connected, web server and UDP listeners up
+  BOOT_COUNT
+};
+
+const char *bootStageNames[BOOT_COUNT] = {"io", "storage", "display", "network"};
+unsigned long bootReady[BOOT_COUNT]; // micros() since power on at which a stage was ready, 0 until then
+
+enum NetStates : uint8_t
+{
+  NET_IDLE,       // WiFi not started
+  NET_CONNECTING, // attempt in progress
+  NET_CONNECTED,
+  NET_RETRY_WAIT, // pause after a failed attempt
+};
+
+const char *netStateNames[] = {"idle", "connecting", "connected", "retryWait"};
+
+struct WifiCache
+{
+  uint32_t magic;
+  uint8_t bssid[6];
+  int32_t channel;
+};
+
+WifiCache wifiCache;
+boolean wifiCacheValid = false;
+boolean storageMounted = false;        // LittleFS is mounted
+NetStates netState = NET_IDLE;
+boolean netUsingCache = false;         // the current attempt skips the scan
+boolean netServicesStarted = false;    // web server and UDP listeners are up
+unsigned long netAttemptStart = 0;     // millis() at the start of the current attempt
+unsigned long netRetryAt = 0;          // millis() of the next attempt in NET_RETRY_WAIT
+unsigned long netRetryMs = WIFI_RETRY_MIN_MS;
+unsigned long netAttempts = 0;         // connect attempts
+unsigned long netConnects = 0;         // successful attempts
+
+void bootStageReady(BootStages stage)
+{
+  if (bootReady[stage])
+    return;
+  bootReady[stage] = micros();
+  Serial.printf("Boot: %s ready after %lu us\n", bootStageNames[stage], bootReady[stage]);
+}
+
+// LittleFS is mounted by storageBegin()
+void wifiCacheLoad()
+{
+  File file = LittleFS.open(WIFI_CACHE_FILE, "r");
+  if (!file)
+    return;
+  wifiCacheValid = file.read((uint8_t *)&wifiCache, sizeof(wifiCache)) == sizeof(wifiCache) &&
+                   wifiCache.magic == WIFI_CACHE_MAGIC;
+  file.close();
+}
+
+// Remember the access point and channel of the connection, the flash is only written when they changed
+void wifiCacheSave()
+{
+  WifiCache current;
+  current.magic = WIFI_CACHE_MAGIC;
+  memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+  current.channel = WiFi.channel();
+  if (wifiCacheValid && memcmp(&current, &wifiCache, sizeof(current)) == 0)
+    return;
+
+  wifiCache = current;
+  wifiCacheValid = true;
+  if (!storageMounted)
+    return;
+  File file = LittleFS.open(WIFI_CACHE_FILE, "w");
+  if (!file)
+    return;
+  file.write((const uint8_t *)&wifiCache, sizeof(wifiCache));
+  file.close();
+}
+
+// Mount LittleFS. A file system that does not mount is never formatted, its files stay as they are
+boolean storageMount()
+{
+#if defined(ESP8266)
+  LittleFSConfig config;
+  config.setAutoFormat(false);
+  LittleFS.setConfig(config);
+  return LittleFS.begin();
+#elif defined(ESP32)
+  return LittleFS.begin(false);
+#endif
+}
+
+// Read the mode profiles and the WiFi cache, called by setup() once the radio is initialised
+void storageBegin()
+{
+  storageMounted = storageMount();
+  if (!storageMounted)
+    Serial.println("LittleFS not mounted, built in modes only");
+
+  loadModeProfiles(storageMounted);
+  selectModeProfile(modeProfile);
+  if (storageMounted)
+    wifiCacheLoad();
+  bootStageReady(BOOT_STORAGE);
+}
+
+void netConnect()
+{
+  netAttempts++;
+  netAttemptStart = millis();
+  netUsingCache = wifiCacheValid;
+  if (netUsingCache)
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD, wifiCache.channel, wifiCache.bssid);
+  else
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  netState = NET_CONNECTING;
+}
+
+// Start WiFi, netTask() follows the attempt from here on
+void netBegin()
+{
+  // the connection parameters are ours to keep, and so is the retry policy
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  netConnect();
+  taskWake(TASK_NET);
+}
+
+void netConnected()
+{
+  netState = NET_CONNECTED;
+  netConnects++;
+  netRetryMs = WIFI_RETRY_MIN_MS;
+  IPAddress ip = WiFi.localIP();
+  snprintf(IP, sizeof(IP), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  wifiCacheSave();
+
+  if (!netServicesStarted)
+  {
+    // UTC from NTP, for the WSJT-X slot boundaries
+    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+
+    server.begin();
+    Udp.begin(localUdpPort);
+    toneUdp.begin(toneUdpPort);
+    netServicesStarted = true;
+  }
+  Serial.printf("Now listening at IP %s, UDP port %d\n", IP, localUdpPort);
+  bootStageReady(BOOT_NETWORK);
+  taskWake(TASK_DISPLAY);
+}
+
+void netFailed()
+{
+  Serial.printf("WiFi: attempt %lu failed\n", netAttempts);
+  WiFi.disconnect();
+
+  // the access point moved or changed channel: scan right away
+  if (netUsingCache)
+  {
+    wifiCacheValid = false;
+    netConnect();
+    return;
+  }
+
+  netState = NET_RETRY_WAIT;
+  netRetryAt = millis() + netRetryMs;
+  netRetryMs = netRetryMs * 2 > WIFI_RETRY_MAX_MS ? WIFI_RETRY_MAX_MS : netRetryMs * 2;
+}
+#pragma endregion Boot
+
+// Device state snapshot
+#pragma region StateSnapshot
+// The status JSON is built in the TCP callback context from a snapshot that loop() publishes,
+// never from the live state. Snapshots are double buffered with a sequence number: loop() fills
+// the buffer readers are not using and then bumps stateSeq, a reader copies the current buffer
+// and retries if stateSeq moved while it was copying
+#define STATE_PUBLISH_US 100000UL // snapshot refresh while nothing changes
+#define STATE_READ_TRIES 4
+
+struct ChannelState
+{
+  boolean active;
+  OperatingModes mode;
+  uint64_t frequency;
+  boolean pllStepping;
+  unsigned long lastTimingErr;
+};
+
+struct TaskState
+{
+  unsigned long runs;
+  unsigned long maxRunTime;
+  unsigned long maxLateness;
+  unsigned long heapAllocs;
+};
+
+struct DeviceState
+{
+  uint64_t frequency;
+  uint8_t modeProfile;
+  char txMessage[100];
+  char myCallsign[10];
+  char dxCallsign[10];
+  char myGridLocator[10];
+  uint8_t dBm;
+  boolean txEnabled;
+  int32_t calibration;
+  int wpm;
+  boolean txVerifyEnabled;
+  ftx_verify_t lastTxVerify;
+  boolean txActive;
+  boolean txArmed;
+  uint8_t armProgress;
+  unsigned long bootReady[BOOT_COUNT];
+  NetStates netState;
+  unsigned long netAttempts;
+  unsigned long txAborts;
+  unsigned long txLastAbortLatency;
+  unsigned long txMaxAbortLatency;
+  uint32_t txPlanErr;
+  uint16_t streamDepth;
+  unsigned long streamFrames;
+  unsigned long streamLate;
+  unsigned long streamUnderruns;
+  unsigned long streamOverruns;
+  ChannelState channels[TX_CHANNELS];
+  TaskState tasks[TASK_COUNT];
+  unsigned long inputDropped;
+  unsigned long tuneUpdates;
+  unsigned long tuneDetents;
+  unsigned long commandsApplied;
+  unsigned long commandsRejected;
+  uint8_t txQueueDepth;
+  unsigned long txQueueStarted;
+  unsigned long txQueueDropped;
+  unsigned long txQueueMaxEncode;
+  uint8_t txQueueEncodeProgress;
+  unsigned long encodeMaxStep;
+  uint32_t idle;
+  uint32_t freeHeap;
+  uint32_t heapMinFree;
+  uint32_t heapMaxBlock;
+  uint16_t i2cQueue;
+  unsigned long i2cFrames;
+  unsigned long i2cChunks;
+  unsigned long i2cDeferred;
+  unsigned long i2cTxWrites;
+  unsigned long i2cMaxChunk;
+  uint32_t i2cBusy;
+};
+
+DeviceState stateBuffers[2];
+volatile uint32_t stateSeq = 0; // stateBuffers[stateSeq & 1] is the current snapshot
+unsigned long stateTornReads = 0; // reads that had to be retried
+
+// Fill the spare buffer from the live state and make it current. loop() only
+void statePublish()
+{
+  DeviceState &s = stateBuffers[(stateSeq + 1) & 1];
+  s.frequency = frequency;
+  s.modeProfile = modeProfile;
+  strcpy(s.txMessage, txMessage);
+  strcpy(s.myCallsign, myCallsign);
+  strcpy(s.dxCallsign, dxCallsign);
+  strcpy(s.myGridLocator, myGridLocator);
+  s.dBm = dBm;
+  s.txEnabled = txEnabled;
+  s.calibration = si5351CalibrationFactor;
+  s.wpm = wpm;
+  s.txVerifyEnabled = txVerifyEnabled;
+  s.lastTxVerify = lastTxVerify;
+  s.txActive = txActive;
+  s.txArmed = txArmed;
+  s.armProgress = encodeJobProgress(wsjtxArmJob);
+  memcpy(s.bootReady, bootReady, sizeof(bootReady));
+  s.netState = netState;
+  s.netAttempts = netAttempts;
+  s.txAborts = txAborts;
+  s.txLastAbortLatency = txLastAbortLatency;
+  s.txMaxAbortLatency = txMaxAbortLatency;
+  s.txPlanErr = txChannels[0].plan.max_err;
+  s.streamDepth = txStream.open ? txStream.head - txStream.next : 0;
+  s.streamFrames = txStream.frames;
+  s.streamLate = txStream.lateFrames;
+  s.streamUnderruns = txStream.underruns;
+  s.streamOverruns = txStream.overruns;
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+  {
+    s.channels[c].active = txChannels[c].active;
+    s.channels[c].mode = txChannels[c].mode;
+    s.channels[c].frequency = txChannels[c].frequency;
+    s.channels[c].pllStepping = txChannels[c].pllStepping;
+    s.channels[c].lastTimingErr = txChannels[c].lastTimingErr;
+  }
+  for (uint8_t i = 0; i < TASK_COUNT; i++)
+  {
+    s.tasks[i].runs = tasks[i].runs;
+    s.tasks[i].maxRunTime = tasks[i].maxRunTime;
+    s.tasks[i].maxLateness = tasks[i].maxLateness;
+    s.tasks[i].heapAllocs = heapCheckAllocs(i);
+  }
+  s.inputDropped = inputDropped;
+  s.tuneUpdates = tuneUpdates;
+  s.tuneDetents = tuneDetents;
+  s.commandsApplied = commandsApplied;
+  s.commandsRejected = commandsRejected;
+  s.txQueueDepth = txQueueCount;
+  s.txQueueStarted = txQueueStarted;
+  s.txQueueDropped = txQueueDropped;
+  s.txQueueMaxEncode = txQueueMaxEncode;
+  s.txQueueEncodeProgress = txQueueEncoded ? 100 : encodeJobProgress(txQueueJob);
+  s.encodeMaxStep = encodeMaxStep;
+  s.idle = (uint32_t)(schedIdleTime / (millis() + 1)); // per mille of uptime
+  s.freeHeap = ESP.getFreeHeap();
+  if (s.freeHeap < heapMinFree)
+    heapMinFree = s.freeHeap;
+  s.heapMinFree = heapMinFree;
+  s.heapMaxBlock = heapLargestBlock();
+  s.i2cQueue = i2cFramePending ? (DISPLAY_BUFFER_SIZE - i2cFrameOffset) / I2C_DISPLAY_CHUNK : 0;
+  s.i2cFrames = i2cFrames;
+  s.i2cChunks = i2cChunks;
+  s.i2cDeferred = i2cDeferred;
+  s.i2cTxWrites = i2cTxWrites;
+  s.i2cMaxChunk = i2cMaxChunkTime;
+  s.i2cBusy = (uint32_t)(i2cBusyTime / (millis() + 1)); // per mille of uptime
+
+  std::atomic_signal_fence(std::memory_order_release);
+  stateSeq = stateSeq + 1;
+}
+
+// Copy the current snapshot. Returns false if loop() kept replacing it
+boolean stateRead(DeviceState &state)
+{
+  for (uint8_t i = 0; i < STATE_READ_TRIES; i++)
+  {
+    uint32_t seq = stateSeq;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    state = stateBuffers[seq & 1];
+    std::atomic_signal_fence(std::memory_order_acquire);
+    if (stateSeq == seq)
+      return true;
+    stateTornReads++;
+  }
+  return false;
+}
+
+unsigned long stateTask()
+{
+  statePublish();
+  return STATE_PUBLISH_US;
+}
+#pragma endregion StateSnapshot
+
+// Webserver
+#pragma region Webserver
+#define MESSAGE_TEXT_SIZE 160 // "message" of a response, fits a /set echo of the longest txMsg
+#define STATUS_ROOT_MEMBERS 57 // members of the sendJSON() root object, keep in step with it
+#define STATUS_TASK_MEMBERS 5  // members of a "tasks" entry, "allocs" only with HEAP_CHECK
+
+// Worst case size of the sendJSON() document: every object and array at its largest, plus the
+// strings ArduinoJson copies (the ones from char arrays). Members dropped by a full document
+// would otherwise vanish from the reply without a trace
+constexpr size_t STATUS_JSON_SIZE =
+    JSON_OBJECT_SIZE(STATUS_ROOT_MEMBERS) +
+    JSON_OBJECT_SIZE(BOOT_COUNT) +
+    JSON_ARRAY_SIZE(MODE_PROFILES_MAX) + MODE_PROFILES_MAX * MODE_NAME_LEN +
+    JSON_ARRAY_SIZE(TX_CHANNELS) + TX_CHANNELS * JSON_OBJECT_SIZE(5) +
+    JSON_ARRAY_SIZE(TASK_COUNT) + TASK_COUNT * JSON_OBJECT_SIZE(STATUS_TASK_MEMBERS) +
+    sizeof(DeviceState::txMessage) + sizeof(DeviceState::myCallsign) + sizeof(DeviceState::dxCallsign) +
+    sizeof(DeviceState::myGridLocator) + MESSAGE_TEXT_SIZE;
+
+// function to send JSON response
+void sendJSON(AsyncWebServerRequest *request, const char *message)
+{
+  // handlers run one at a time, so one copy serves them all
+  static DeviceState state;
+  if (!stateRead(state))
+  {
+    request->send(503);
+    return;
+  }
+
+  AsyncJsonResponse *response = new AsyncJsonResponse(false, STATUS_JSON_SIZE);
+  response->addHeader("Server", "ESP Async Web Server");
+  JsonVariant &root = response->getRoot();
+  root["freq"] = state.frequency;
+  root["opMode"] = state.modeProfile;
+  root["txMsg"] = state.txMessage;
+  root["myCall"] = state.myCallsign;
+  root["dxCall"] = state.dxCallsign;
+  root["dBm"] = state.dBm;
+  root["txEn"] = state.txEnabled;
+  root["myGrid"] = state.myGridLocator;
+  root["cal"] = state.calibration;
+  root["wpm"] = state.wpm;
+  root["txVerify"] = state.txVerifyEnabled;
+  root["txCheck"] = ftx_verify_text(state.lastTxVerify);
+  root["txActive"] = state.txActive;
+  root["txArmed"] = state.txArmed;
+  root["armProgress"] = state.armProgress;
+  JsonObject boot = root.createNestedObject("boot");
+  for (uint8_t i = 0; i < BOOT_COUNT; i++)
+    boot[bootStageNames[i]] = state.bootReady[i];
+  root["wifi"] = netStateNames[state.netState];
+  root["wifiAttempts"] = state.netAttempts;
+  root["txAborts"] = state.txAborts;
+  root["txAbortLatency"] = state.txLastAbortLatency;
+  root["txAbortMaxLatency"] = state.txMaxAbortLatency;
+  root["clockSet"] = time(NULL) >= NTP_VALID_EPOCH;
+  root["txMaxErr"] = state.channels[0].lastTimingErr;
+  root["txPllStep"] = state.channels[0].pllStepping;
+  root["txPlanErr"] = state.txPlanErr;
+  root["streamDepth"] = state.streamDepth;
+  root["streamFrames"] = state.streamFrames;
+  root["streamLate"] = state.streamLate;
+  root["streamUnderruns"] = state.streamUnderruns;
+  root["streamOverruns"] = state.streamOverruns;
+  // the profile table does not change after boot
+  JsonArray modes = root.createNestedArray("modes");
+  for (uint8_t i = 0; i < modeProfileCount; i++)
+    modes.add(modeProfiles[i].name);
+  JsonArray channels = root.createNestedArray("channels");
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+  {
+    JsonObject channel = channels.createNestedObject();
+    channel["active"] = state.channels[c].active;
+    channel["opMode"] = state.channels[c].mode;
+    channel["freq"] = state.channels[c].frequency;
+    channel["pllStep"] = state.channels[c].pllStepping;
+    channel["maxErr"] = state.channels[c].lastTimingErr;
+  }
+  JsonArray taskStats = root.createNestedArray("tasks");
+  for (uint8_t i = 0; i < TASK_COUNT; i++)
+  {
+    JsonObject task = taskStats.createNestedObject();
+    task["name"] = tasks[i].name;
+    task["runs"] = state.tasks[i].runs;
+    task["maxRun"] = state.tasks[i].maxRunTime;
+    task["maxLate"] = state.tasks[i].maxLateness;
+#ifdef HEAP_CHECK
+    task["allocs"] = state.tasks[i].heapAllocs;
+#endif
+  }
+  root["inputDropped"] = state.inputDropped;
+  root["tuneUpdates"] = state.tuneUpdates;
+  root["tuneDetents"] = state.tuneDetents;
+  root["commands"] = state.commandsApplied;
+  root["commandsRejected"] = state.commandsRejected;
+  root["txQueue"] = state.txQueueDepth;
+  root["txQueueStarted"] = state.txQueueStarted;
+  root["txQueueDropped"] = state.txQueueDropped;
+  root["txQueueMaxEncode"] = state.txQueueMaxEncode;
+  root["txQueueEncodeProgress"] = state.txQueueEncodeProgress;
+  root["encodeMaxStep"] = state.encodeMaxStep;
+  root["stateTornReads"] = stateTornReads;
+  root["idle"] = state.idle;
+  root["freeHeap"] = state.freeHeap;
+  root["heapMinFree"] = state.heapMinFree;
+  root["heapMaxBlock"] = state.heapMaxBlock;
+  root["i2cQueue"] = state.i2cQueue;
+  root["i2cFrames"] = state.i2cFrames;
+  root["i2cChunks"] = state.i2cChunks;
+  root["i2cDeferred"] = state.i2cDeferred;
+  root["i2cTxWrites"] = state.i2cTxWrites;
+  root["i2cMaxChunk"] = state.i2cMaxChunk;
+  root["i2cBusy"] = state.i2cBusy;
+  // as a char * ArduinoJson copies the text, the caller's buffer is gone once the response is sent.
+  // It is written last, so it only fails if the document ran out of room
+  if (!root["message"].set(const_cast<char *>(message)))
+    Serial.printf("Status reply over %u bytes, members dropped\n", (unsigned)STATUS_JSON_SIZE);
+  response->setLength();
+  request->send(response);
+}
+
+#pragma endregion Webserver
+
+// Display functionality
+#pragma region Display
+// drawString() takes a String. Lines are formatted into a fixed buffer and copied into one String
+// whose capacity is reserved by displayInit(), so drawing a frame never touches the heap. The
+// frequency is printed from centi-Hz with integer arithmetic, there is no FPU to lean on
+#define DISPLAY_LINE_SIZE 112 // longest line, a txMessage with its terminator
+
+String displayLine;
+
+void drawLine(int16_t x, int16_t y, const char *format, ...)
+{
+  char text[DISPLAY_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  displayLine = text;
+  display.drawString(x, y, displayLine);
+}
+
+// Frequency in centi-Hz as MHz with 6 decimals, like 7.074000MHz
+void drawFrequency(int16_t x, int16_t y, uint64_t centiHz)
+{
+  uint32_t hz = (uint32_t)(centiHz / 100);
+  drawLine(x, y, "%lu.%06luMHz", (unsigned long)(hz / 1000000), (unsigned long)(hz % 1000000));
+}
+
+// Primary frame. Shows the most important device states
+void showScreen1()
+{
+  display.clear();
+
+  display.setFont(Roboto_Mono_Thin_16);
+  drawFrequency(0, 0, frequency);
+
+  display.setFont(ArialMT_Plain_10);
+  drawLine(0, 20, "Mode: %s", deviceModeTexts[deviceMode]);
+  drawLine(0, 30, "OpMode: %s", modeProfiles[modeProfile].name);
+  drawLine(0, 40, "WPM: %d", wpm);
+  drawLine(0, 50, "IP: %s", IP);
+
+  i2cQueueFrame();
+}
+
+void showScreenWSJTX()
+{
+  display.clear();
 
   display.setFont(Roboto_Mono_Thin_16);
-  display.drawString(0, 0, String((double)frequency / 100000000, 6U) + "MHz");
+  drawFrequency(0, 0, frequency);
 
   display.setFont(ArialMT_Plain_10);
-  display.drawString(0, 20, "DeviceMode: " + deviceModeTexts[deviceMode]);
-  display.drawString(0, 30, "OpMode: " + operatingModeTexts[operatingMode]);
+  drawLine(0, 20, "DeviceMode: %s", deviceModeTexts[deviceMode]);
+  drawLine(0, 30, "OpMode: %s", modeProfiles[modeProfile].name);
   if (operatingMode == MODE_WSPR)
   {
-    display.drawString(0, 40, myCallsign + String(" ") + myGridLocator + String(" ") + String(dBm));
+    drawLine(0, 40, "%s %s %u", myCallsign, myGridLocator, dBm);
   }
   else
   {
-    display.drawString(0, 40, String(txMessage));
+    drawLine(0, 40, "%s", txMessage);
   }
-  display.drawString(0, 50, "TxEnabled: " + String(txEnabled ? "true" : "false"));
+  drawLine(0, 50, "TxEnabled: %s", txEnabled ? "true" : "false");
+
+  i2cQueueFrame();
+}
 
-  display.display();
+// Bring up the display controller, after the keyer is ready. display.init() clears the screen
+// with one blocking frame push, every later frame goes out in chunks from i2cTask()
+void displayInit()
+{
+  display.init();
+  display.flipScreenVertically();
+  display.setFont(ArialMT_Plain_10);
+  displayLine.reserve(DISPLAY_LINE_SIZE);
+  bootStageReady(BOOT_DISPLAY);
 }
 
 void updateDisplay()
 {
+  // the frame buffer is allocated by display.init()
+  if (!bootReady[BOOT_DISPLAY])
+    return;
+
   if (deviceMode == WSJTX)
   {
     showScreenWSJTX();
@@ -581,8 +3207,10 @@ void setup()
   else
     digitalWrite(PTT_PIN, LOW);
 
-  // Start serial and initialize the Si5351
+  // Start serial
   Serial.begin(115200);
+
+  // Initialize the Si5351
   si5351.init(SI5351_CRYSTAL_LOAD_8PF, 0, 0);
 
   si5351.set_correction(si5351CalibrationFactor, SI5351_PLL_INPUT_XO);
@@ -594,17 +3222,24 @@ void setup()
   // output on/off
   si5351.output_enable(SI5351_CLK0, 0);
 
-  // Setup WiFi
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  if (WiFi.waitForConnectResult() != WL_CONNECTED)
-  {
-    Serial.printf("WiFi Failed!\n");
-    return;
-  }
-  Serial.print("IP Address: ");
-  strcpy(IP, WiFi.localIP().toString().c_str());
-  Serial.println(IP);
+  // CLK1 and CLK2 are the beacon channels. They share PLLB so CLK0 has PLLA to itself
+  si5351.set_ms_source(SI5351_CLK1, SI5351_PLLB);
+  si5351.set_ms_source(SI5351_CLK2, SI5351_PLLB);
+  si5351.set_freq(frequency, SI5351_CLK1);
+  si5351.set_freq(frequency, SI5351_CLK2);
+  si5351.drive_strength(SI5351_CLK1, SI5351_DRIVE_8MA);
+  si5351.drive_strength(SI5351_CLK2, SI5351_DRIVE_8MA);
+  si5351.output_enable(SI5351_CLK1, 0);
+  si5351.output_enable(SI5351_CLK2, 0);
+  for (uint8_t c = 0; c < TX_CHANNELS; c++)
+    txChannels[c].clk = static_cast<enum si5351_clock>(SI5351_CLK0 + c);
+
+  // Morse
+  morse.output_pin = 0;
+  bootStageReady(BOOT_IO);
+
+  // Mode profiles and WiFi cache, with the radio already up
+  storageBegin();
 
   // Webserver Handlers
 #pragma region WebserverHandlers
@@ -620,57 +3255,150 @@ void setup()
               
               if (request->hasParam("key") && request->hasParam("value"))
               {
-                String key = request->getParam("key")->value();
-                String value = request->getParam("value")->value();
-
-                if(key == "freq"){
-                  // set frequency
-                  setFrequency(value);
-                  sendJSON(request, "Freq set to : " + String((double)frequency/100000000, 8U));
-                } else if(key == "opMode"){
-                  // set operatingMode
-                  setOperatingMode(value);
-                  sendJSON(request, "Mode set to : " + operatingModeTexts[operatingMode]);
-                } else if(key == "txMsg"){
-                  // set txMessage
-                  setTxMessage(value);
-                  sendJSON(request, "TxMsg set to : " + String(txMessage));
-                } else if(key == "txEn"){
-                  // set txEnabled
-                  setTxEnabled(value);
-                  sendJSON(request, "TxEnabled set to : " + txEnabled ? "true" : "false");
-                } else if(key == "wpm"){
-                  // set wpm
-                  setMorseWPM(value);
-                  sendJSON(request, "WPM set to : " + String(wpm));
-                } else if(key == "myCall"){
-                  // set myCallsign
-                  setMyCallsign(value);
-                  sendJSON(request, "My call set to : " + String(myCallsign));
-                } else if(key == "dxCall"){
-                  // set dxCallsign
-                  setDxCallsign(value);
-                  sendJSON(request, "Dx call set to : " + String(dxCallsign));
-                } else if(key == "myGrid"){
-                  // set myGridLocator
-                  setMyGrid(value);
-                  sendJSON(request, "My Grid set to : " + String(myGridLocator));
-                } else if(key == "cal"){
-                  // set si5351CalibrationFactor
-                  setCalibration(value);
-                  sendJSON(request, "Cal factor set to : " + String(si5351CalibrationFactor));
-                } else {
-                  // key not matched
+                const char *key = request->getParam("key")->value().c_str();
+                const char *value = request->getParam("value")->value().c_str();
+
+                SetKeys k = findSetKey(key);
+                if (k == SET_KEY_COUNT)
+                {
                   sendJSON(request, "Invalid params");
                 }
-
-                refreshDisplay = true;
+                else if (!commandSet(k, value))
+                {
+                  sendJSON(request, "Busy, try again");
+                }
+                else
+                {
+                  char text[MESSAGE_TEXT_SIZE];
+                  snprintf(text, sizeof(text), "%s set to : %s", key, value);
+                  sendJSON(request, text);
+                }
               }
               else
               {
                 sendJSON(request, "Invalid params");
               } });
 
+  // POST a tone frame (see lib/ToneFrame) to <IP>/tones to play it, or to <IP>/tones?queue to
+  // queue it on channel 0
+  server.on(
+      "/tones", HTTP_POST, [](AsyncWebServerRequest *request)
+      {
+        // with ?queue the tones go to the TX queue of channel 0 instead of starting right away
+        boolean queue = request->hasParam("queue");
+        HttpToneUpload *upload = static_cast<HttpToneUpload *>(request->_tempObject);
+        tone_frame_result_t result = upload ? upload->result : TONE_FRAME_SHORT;
+        if (queue && result == TONE_FRAME_OK && upload->frame.channel != 0)
+          result = TONE_FRAME_REJECTED;
+        Command *command = result == TONE_FRAME_OK ? commandSlot() : NULL;
+        if (command != NULL)
+        {
+          command->type = queue ? CMD_QUEUE_TONES : CMD_TONES;
+          command->frame = upload->frame;
+          memcpy(command->data, upload->tones, sizeof(upload->tones));
+          commandPush();
+        }
+        else if (result == TONE_FRAME_OK)
+        {
+          result = TONE_FRAME_REJECTED;
+        }
+        char text[MESSAGE_TEXT_SIZE];
+        snprintf(text, sizeof(text), "Tones: %s", tone_frame_text(result));
+        sendJSON(request, text); },
+      NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+      { toneFrameBody(request, data, len, index, total); });
+
+  // Start or stop a beacon channel on CLK1 or CLK2 while channel 0 keeps working as usual.
+  // Send a GET request to <IP>/chan?ch=<1|2>&opMode=<mode>&freq=<freq>&txMsg=<message>
+  // txMsg defaults to the current txMessage. <IP>/chan?ch=<1|2>&txEn=false stops the channel
+  server.on("/chan", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              long channel = request->hasParam("ch") ? request->getParam("ch")->value().toInt() : 0;
+              if (channel < 1 || channel >= TX_CHANNELS)
+              {
+                sendJSON(request, "Invalid params");
+                return;
+              }
+
+              Command *command = commandSlot();
+              if (command == NULL)
+              {
+                sendJSON(request, "Busy, try again");
+                return;
+              }
+
+              if (request->hasParam("txEn") && request->getParam("txEn")->value() == "false")
+              {
+                command->type = CMD_CHANNEL_STOP;
+                command->channel = channel;
+                commandPush();
+                char text[MESSAGE_TEXT_SIZE];
+                snprintf(text, sizeof(text), "Channel %ld stopping", channel);
+                sendJSON(request, text);
+                return;
+              }
+
+              if (!request->hasParam("opMode") || !request->hasParam("freq"))
+              {
+                sendJSON(request, "Invalid params");
+                return;
+              }
+
+              // the message defaults to txMessage as it is when the command is applied
+              char *message = (char *)command->data;
+              message[0] = 0;
+              if (request->hasParam("txMsg"))
+                strncpy(message, request->getParam("txMsg")->value().c_str(), sizeof(txMessage) - 1);
+              message[sizeof(txMessage) - 1] = 0;
+              command->type = CMD_CHANNEL_START;
+              command->channel = channel;
+              command->profile = request->getParam("opMode")->value().toInt();
+              command->frequency = strtoull(request->getParam("freq")->value().c_str(), NULL, 10);
+              commandPush();
+              char text[MESSAGE_TEXT_SIZE];
+              snprintf(text, sizeof(text), "Channel %ld starting", channel);
+              sendJSON(request, text); });
+
+  // Queue a message on channel 0 behind the ones already queued.
+  // Send a GET request to <IP>/queue?opMode=<mode>&freq=<freq>&txMsg=<message>&slot=<slot>
+  // slot is the slot index since the epoch (UTC seconds * 1000 / slot length), left out for the
+  // first free slot. txMsg defaults to the current txMessage. <IP>/queue?clear empties the queue
+  server.on("/queue", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+              boolean clear = request->hasParam("clear");
+              if (!clear && (!request->hasParam("opMode") || !request->hasParam("freq")))
+              {
+                sendJSON(request, "Invalid params");
+                return;
+              }
+
+              Command *command = commandSlot();
+              if (command == NULL)
+              {
+                sendJSON(request, "Busy, try again");
+                return;
+              }
+
+              if (clear)
+              {
+                command->type = CMD_QUEUE_CLEAR;
+                commandPush();
+                sendJSON(request, "Queue clearing");
+                return;
+              }
+
+              char *message = (char *)command->data;
+              message[0] = 0;
+              if (request->hasParam("txMsg"))
+                strncpy(message, request->getParam("txMsg")->value().c_str(), sizeof(txMessage) - 1);
+              message[sizeof(txMessage) - 1] = 0;
+              command->type = CMD_QUEUE;
+              command->profile = request->getParam("opMode")->value().toInt();
+              command->frequency = strtoull(request->getParam("freq")->value().c_str(), NULL, 10);
+              command->slot = request->hasParam("slot") ? strtoul(request->getParam("slot")->value().c_str(), NULL, 10) : 0;
+              commandPush();
+              sendJSON(request, "Message queued"); });
+
   // CORS headers
   DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
 
@@ -684,225 +3412,162 @@ void setup()
                       } });
 #pragma endregion WebserverHandlers
 
-  // Start Webserver
-  server.begin();
-
-  // Begin UDP Listener
-  Udp.begin(localUdpPort);
-  Serial.printf("Now listening at IP %s, UDP port %d\n", IP, localUdpPort);
-
-  // Morse
-  morse.output_pin = 0;
-
-  // Initialising the UI
-  display.init();
-  display.flipScreenVertically();
-  display.setFont(ArialMT_Plain_10);
-  updateDisplay();
+  // WiFi, the web server and the UDP listeners come up in the background, see netTask().
+  // The display is initialised by the first displayTask() run
+  netBegin();
 }
 
 unsigned long now = 0;
-int previousRotaryCounter = 0;
-// main loop
-void loop()
-{
-  now = millis();
-
-  if (refreshDisplay)
-  {
-    updateDisplay();
-    refreshDisplay = false;
-  }
 
-  // Print a counter based on rotarystate and change deviveMode for testing
-  if (previousRotaryCounter != rotaryCounter)
-  {
-    Serial.println(rotaryCounter);
-    previousRotaryCounter = rotaryCounter;
-    deviceMode = static_cast<DeviceModes>((rotaryCounter % 3 + 3) % 3);
-    updateDisplay();
-  }
+// Scheduled tasks
+#pragma region Tasks
+// Each task does a bounded slice of work and returns the time in us until it has to run again,
+// or TASK_SLEEP to wait for a taskWake(). Tasks of other device modes poll at TASK_POLL_US
+#define TASK_POLL_US 100000UL   // poll of a task that has nothing to do in this device mode
+#define KEYER_TICK_US 1000UL    // keyer and morse timing resolution, they count ms
+#define WSJTX_POLL_US 5000UL    // WSJT-X packets wait in the UDP buffer meanwhile
+#define TONE_POLL_US 2000UL     // tone frames wait in the UDP buffer meanwhile
+#define NET_CONNECT_POLL_US 50000UL // WiFi status poll during a connect attempt
+#define NET_POLL_US 500000UL        // WiFi status poll while connected
+#define SCHED_PASS_BUDGET_US 2000 // longest scheduler pass before loop() hands the CPU back
+#define SCHED_IDLE_MIN_US 2000    // sleep only if nothing is due for this long
+#define SCHED_IDLE_MAX_US 5000    // longest sleep before loop() returns
+#define SCHED_IDLE_SLICE_MS 1     // sleep slice, bounds the reaction to a wake from an ISR
+
+unsigned long txTask()
+{
+  txEngineUpdate();
+  return txTimeToDeadline(); // TASK_SLEEP when nothing is on air
+}
 
-  if (deviceMode == STANDALONE)
+// Drain the input events. Paddles update the keyer, detents are summed into tunePending and the
+// button stops every channel on air, or cycles the device mode when nothing is
+unsigned long inputTask()
+{
+  InputEvent event;
+  while (inputPop(event))
   {
-    // standalone logic
-    if (operatingMode == MODE_CW)
+    switch (event.type)
     {
-      // CW Keyer State machine
-#pragma region CW_Keyer_State_Machine
-      switch (keyerState)
-      {
-      case START:
-
-        if (ditState)
-          keyerState = DITSTATE;
-        else if (dahState)
-          keyerState = DAHSTATE;
-
-        break;
-
-      case DITSTATE:
-        // Before dit start:
-        if (!sendingDit && !completedDit)
-        {
-          sendingDit = true;
-          lastDitTriggerd = now;
-          keyDown();
-          break;
-        }
+    case INPUT_DIT:
+      ditState = event.value;
+      ditLatched |= ditState;
+      taskWake(TASK_STANDALONE);
+      break;
 
-        // After dit started:
-        if (sendingDit && !completedDit)
-        {
-          if (now - lastDitTriggerd >= ditLength)
-          {
-            lastDitTriggerd = 0;
-            sendingDit = false;
-            completedDit = true;
-            keyUp();
-            keyerIdle = true;
-            lastKeyerIdleTriggered = now;
-            break;
-          }
+    case INPUT_DAH:
+      dahState = event.value;
+      dahLatched |= dahState;
+      taskWake(TASK_STANDALONE);
+      break;
 
-          // check opposite paddle
-          if (dahState)
-          {
-            nextKeyerStateSet = true;
-            nextKeyerState = DAHSTATE;
-          }
-        }
+    case INPUT_ROTATE:
+      tunePending += (int64_t)event.value * tuneStep(event.time - lastDetentTime) * SI5351_FREQ_MULT;
+      lastDetentTime = event.time;
+      tuneDetents++;
+      break;
 
-        // After dit ended:
-        if (!sendingDit && completedDit)
+    case INPUT_BUTTON:
+      if (event.value && !rotaryButtonDown)
+      {
+        if (txActive)
         {
-          if (now - lastKeyerIdleTriggered > ditLength)
-          {
-            keyerState = nextKeyerState;
-            nextKeyerStateSet = false;
-
-            keyerIdle = false;
-            lastKeyerIdleTriggered = 0;
-            completedDit = false;
-            break;
-          }
-          else
-          {
-            if (!nextKeyerStateSet)
-            {
-              // check paddles
-              if (ditState && dahState)
-              {
-                nextKeyerState = DAHSTATE;
-                nextKeyerStateSet = true;
-              }
-              else if (dahState)
-              {
-                nextKeyerState = DAHSTATE;
-                nextKeyerStateSet = true;
-              }
-              else if (ditState)
-              {
-                nextKeyerState = DITSTATE;
-                nextKeyerStateSet = true;
-              }
-              else
-              {
-                nextKeyerState = ENDCHAR;
-              }
-            }
-          }
+          txRequestAbort((1 << TX_CHANNELS) - 1, event.time);
         }
-
-        break;
-
-      case DAHSTATE:
-        // Before dah start:
-        if (!sendingDah && !completedDah)
+        else
         {
-          sendingDah = true;
-          lastDahTriggerd = now;
-          keyDown();
-          break;
+          deviceMode = static_cast<DeviceModes>((deviceMode + 1) % 3);
+          taskWake(TASK_STANDALONE);
+          taskWake(TASK_WEB);
+          taskWake(TASK_WSJTX);
+          taskWake(TASK_DISPLAY);
         }
+      }
+      rotaryButtonDown = event.value;
+      break;
+    }
+  }
 
-        // After dah started:
-        if (sendingDah && !completedDah)
-        {
-          if (now - lastDahTriggerd >= dahLength)
-          {
-            lastDahTriggerd = 0;
-            sendingDah = false;
-            completedDah = true;
-            keyUp();
-            keyerIdle = true;
-            lastKeyerIdleTriggered = now;
-            break;
-          }
+  // one frequency update per frame
+  if (tunePending)
+  {
+    unsigned long sinceTune = micros() - lastTuneTime;
+    if (sinceTune < TUNE_FRAME_US)
+      return TUNE_FRAME_US - sinceTune;
+    tuneApply();
+  }
 
-          // check opposite paddle
-          if (ditState)
-          {
-            nextKeyerStateSet = true;
-            nextKeyerState = DITSTATE;
-          }
-        }
+  // woken by inputPush()
+  return TASK_SLEEP;
+}
 
-        // After dah ended:
-        if (!sendingDah && completedDah)
-        {
-          if (now - lastKeyerIdleTriggered > ditLength)
-          {
-            keyerState = nextKeyerState;
-            nextKeyerStateSet = false;
-            keyerIdle = false;
-            lastKeyerIdleTriggered = 0;
-            completedDah = false;
-            break;
-          }
-          else
-          {
-            if (!nextKeyerStateSet)
-            {
-              // check paddles
-              if (ditState && dahState)
-              {
-                nextKeyerState = DITSTATE;
-                nextKeyerStateSet = true;
-              }
-              else if (dahState)
-              {
-                nextKeyerState = DAHSTATE;
-                nextKeyerStateSet = true;
-              }
-              else if (ditState)
-              {
-                nextKeyerState = DITSTATE;
-                nextKeyerStateSet = true;
-              }
-              else
-              {
-                nextKeyerState = ENDCHAR;
-              }
-            }
-          }
-        }
+unsigned long standaloneTask()
+{
+  if (deviceMode != STANDALONE)
+    return TASK_POLL_US;
 
+  now = millis();
+
+  // standalone logic
+  if (operatingMode == MODE_CW)
+  {
+    // CW Keyer State machine
+#pragma region CW_Keyer_State_Machine
+    switch (keyerState)
+    {
+    case START:
+
+      if (ditPressed())
+        keyerState = DITSTATE;
+      else if (dahPressed())
+        keyerState = DAHSTATE;
+
+      break;
+
+    case DITSTATE:
+      // Before dit start:
+      if (!sendingDit && !completedDit)
+      {
+        sendingDit = true;
+        ditLatched = false;
+        lastDitTriggerd = now;
+        keyDown();
         break;
+      }
 
-      case ENDCHAR:
-        if (!keyerIdle)
+      // After dit started:
+      if (sendingDit && !completedDit)
+      {
+        if (now - lastDitTriggerd >= ditLength)
         {
+          lastDitTriggerd = 0;
+          sendingDit = false;
+          completedDit = true;
+          keyUp();
           keyerIdle = true;
           lastKeyerIdleTriggered = now;
+          break;
+        }
+
+        // check opposite paddle
+        if (dahPressed())
+        {
+          nextKeyerStateSet = true;
+          nextKeyerState = DAHSTATE;
         }
+      }
 
-        if (now - lastKeyerIdleTriggered > ditLength * 2)
+      // After dit ended:
+      if (!sendingDit && completedDit)
+      {
+        if (now - lastKeyerIdleTriggered > ditLength)
         {
           keyerState = nextKeyerState;
           nextKeyerStateSet = false;
+
           keyerIdle = false;
           lastKeyerIdleTriggered = 0;
+          completedDit = false;
           break;
         }
         else
@@ -910,38 +3575,74 @@ void loop()
           if (!nextKeyerStateSet)
           {
             // check paddles
-            if (dahState)
+            if (ditPressed() && dahPressed())
+            {
+              nextKeyerState = DAHSTATE;
+              nextKeyerStateSet = true;
+            }
+            else if (dahPressed())
             {
               nextKeyerState = DAHSTATE;
               nextKeyerStateSet = true;
             }
-            else if (ditState)
+            else if (ditPressed())
             {
               nextKeyerState = DITSTATE;
               nextKeyerStateSet = true;
             }
             else
             {
-              nextKeyerState = ENDWORD;
+              nextKeyerState = ENDCHAR;
             }
           }
         }
+      }
 
+      break;
+
+    case DAHSTATE:
+      // Before dah start:
+      if (!sendingDah && !completedDah)
+      {
+        sendingDah = true;
+        dahLatched = false;
+        lastDahTriggerd = now;
+        keyDown();
         break;
+      }
 
-      case ENDWORD:
-        if (!keyerIdle)
+      // After dah started:
+      if (sendingDah && !completedDah)
+      {
+        if (now - lastDahTriggerd >= dahLength)
         {
+          lastDahTriggerd = 0;
+          sendingDah = false;
+          completedDah = true;
+          keyUp();
           keyerIdle = true;
           lastKeyerIdleTriggered = now;
+          break;
+        }
+
+        // check opposite paddle
+        if (ditPressed())
+        {
+          nextKeyerStateSet = true;
+          nextKeyerState = DITSTATE;
         }
+      }
 
-        if (now - lastKeyerIdleTriggered > ditLength * 4)
+      // After dah ended:
+      if (!sendingDah && completedDah)
+      {
+        if (now - lastKeyerIdleTriggered > ditLength)
         {
           keyerState = nextKeyerState;
           nextKeyerStateSet = false;
           keyerIdle = false;
           lastKeyerIdleTriggered = 0;
+          completedDah = false;
           break;
         }
         else
@@ -949,428 +3650,589 @@ void loop()
           if (!nextKeyerStateSet)
           {
             // check paddles
-            if (dahState)
+            if (ditPressed() && dahPressed())
+            {
+              nextKeyerState = DITSTATE;
+              nextKeyerStateSet = true;
+            }
+            else if (dahPressed())
             {
               nextKeyerState = DAHSTATE;
               nextKeyerStateSet = true;
             }
-            else if (ditState)
+            else if (ditPressed())
             {
               nextKeyerState = DITSTATE;
               nextKeyerStateSet = true;
             }
             else
             {
-              nextKeyerState = START;
+              nextKeyerState = ENDCHAR;
             }
           }
         }
+      }
 
+      break;
+
+    case ENDCHAR:
+      if (!keyerIdle)
+      {
+        keyerIdle = true;
+        lastKeyerIdleTriggered = now;
+      }
+
+      if (now - lastKeyerIdleTriggered > ditLength * 2)
+      {
+        keyerState = nextKeyerState;
+        nextKeyerStateSet = false;
+        keyerIdle = false;
+        lastKeyerIdleTriggered = 0;
         break;
       }
-#pragma endregion CW_Keyer_State_Machine
-    }
-    else if (operatingMode == MODE_WSPR)
-    {
-      // standalone WSPR logic here
-    }
-  }
-  else if (deviceMode == WEBSERVER)
-  {
-    // web server logic here
-    switch (operatingMode)
-    {
-    case MODE_CW:
-      // cw logic
-      if (txEnabled)
+      else
       {
-        // Start sending morse
-        if (!morseTxMsgSet)
-        {
-          morse.send(txMessage);
-          morseTxMsgSet = true;
-        }
-        else
+        if (!nextKeyerStateSet)
         {
-          // Morse sent
-          if (!morse.busy)
+          // check paddles
+          if (dahPressed())
           {
-            morseTxMsgSet = false;
-            txEnabled = false;
+            nextKeyerState = DAHSTATE;
+            nextKeyerStateSet = true;
+          }
+          else if (ditPressed())
+          {
+            nextKeyerState = DITSTATE;
+            nextKeyerStateSet = true;
           }
-        }
-
-        // update every 1 milisecond
-        if (now != previousMorseMilis)
-        {
-          morse.update();
-
-          if (morse.tx)
-            keyDown();
           else
-            keyUp();
-
-          previousMorseMilis = now;
+          {
+            nextKeyerState = ENDWORD;
+          }
         }
       }
-      break;
 
-    case MODE_PIXIE_CW:
-      // pixie cw logic goes here
       break;
 
-    case MODE_JT9:
-      symbolCount = JT9_SYMBOL_COUNT; // From the library defines
-      toneSpacing = JT9_TONE_SPACING;
-      toneDelay = JT9_DELAY;
-      break;
-    case MODE_JT65:
-      symbolCount = JT65_SYMBOL_COUNT; // From the library defines
-      toneSpacing = JT65_TONE_SPACING;
-      toneDelay = JT65_DELAY;
-      break;
-    case MODE_JT4:
-      symbolCount = JT4_SYMBOL_COUNT; // From the library defines
-      toneSpacing = JT4_TONE_SPACING;
-      toneDelay = JT4_DELAY;
-      break;
-    case MODE_WSPR:
-      symbolCount = WSPR_SYMBOL_COUNT; // From the library defines
-      toneSpacing = WSPR_TONE_SPACING;
-      toneDelay = WSPR_DELAY;
-      break;
-    case MODE_FT8:
-      symbolCount = FT8_SYMBOL_COUNT; // From the library defines
-      toneSpacing = FT8_TONE_SPACING;
-      toneDelay = FT8_DELAY;
-      break;
-    case MODE_FSQ_2:
-      toneSpacing = FSQ_TONE_SPACING;
-      toneDelay = FSQ_2_DELAY;
-      if (txEnabled)
+    case ENDWORD:
+      if (!keyerIdle)
       {
-        setTxBuffer();
-        jtTransmitMessage();
-        txEnabled = false;
+        keyerIdle = true;
+        lastKeyerIdleTriggered = now;
       }
-      break;
 
-    case MODE_FSQ_3:
-      toneSpacing = FSQ_TONE_SPACING;
-      toneDelay = FSQ_3_DELAY;
-      if (txEnabled)
+      if (now - lastKeyerIdleTriggered > ditLength * 4)
       {
-        setTxBuffer();
-        jtTransmitMessage();
-        txEnabled = false;
+        keyerState = nextKeyerState;
+        nextKeyerStateSet = false;
+        keyerIdle = false;
+        lastKeyerIdleTriggered = 0;
+        break;
+      }
+      else
+      {
+        if (!nextKeyerStateSet)
+        {
+          // check paddles
+          if (dahPressed())
+          {
+            nextKeyerState = DAHSTATE;
+            nextKeyerStateSet = true;
+          }
+          else if (ditPressed())
+          {
+            nextKeyerState = DITSTATE;
+            nextKeyerStateSet = true;
+          }
+          else
+          {
+            nextKeyerState = START;
+          }
+        }
       }
+
       break;
+    }
+#pragma endregion CW_Keyer_State_Machine
+  }
+  else if (operatingMode == MODE_WSPR)
+  {
+    // standalone WSPR logic here
+  }
+
+  // a keyer at rest waits for a paddle ISR, otherwise it times its elements to the ms
+  if (operatingMode == MODE_CW && (keyerState != START || ditPressed() || dahPressed()))
+    return KEYER_TICK_US;
+  return operatingMode == MODE_CW ? TASK_SLEEP : TASK_POLL_US;
+}
+
+unsigned long webTask()
+{
+  if (deviceMode != WEBSERVER)
+    return TASK_POLL_US;
+
+  now = millis();
 
-    case MODE_FSQ_4_5:
-      toneSpacing = FSQ_TONE_SPACING;
-      toneDelay = FSQ_4_5_DELAY;
-      if (txEnabled)
+  switch (operatingMode)
+  {
+  case MODE_CW:
+    // cw logic
+    if (txEnabled)
+    {
+      // Start sending morse
+      if (!morseTxMsgSet)
       {
-        setTxBuffer();
-        jtTransmitMessage();
-        txEnabled = false;
+        morse.send(txMessage);
+        morseTxMsgSet = true;
+      }
+      else
+      {
+        // Morse sent
+        if (!morse.busy)
+        {
+          morseTxMsgSet = false;
+          txEnabled = false;
+        }
       }
-      break;
 
-    case MODE_FSQ_6:
-      toneSpacing = FSQ_TONE_SPACING;
-      toneDelay = FSQ_6_DELAY;
-      if (txEnabled)
+      // update every 1 milisecond
+      if (now != previousMorseMilis)
       {
-        setTxBuffer();
-        jtTransmitMessage();
-        txEnabled = false;
+        morse.update();
+
+        if (morse.tx)
+          keyDown();
+        else
+          keyUp();
+
+        previousMorseMilis = now;
       }
-      break;
     }
+    else if (morseTxMsgSet)
+    {
+      // disabled in the middle of the message
+      morseTxMsgSet = false;
+      keyUp();
+    }
+    break;
+
+  case MODE_PIXIE_CW:
+    // pixie cw logic goes here
+    break;
+
+  case MODE_FSQ_2:
+  case MODE_FSQ_3:
+  case MODE_FSQ_4_5:
+  case MODE_FSQ_6:
+    if (txEnabled && !txChannelActive(0))
+    {
+      setTxBuffer();
+      jtTransmitMessage(micros());
+      txEnabled = false;
+    }
+    break;
 
-    // todo: for tx call : setTxBuffer() and jtTransmitMessage()
+  default:
+    break;
   }
-  else
+
+  // todo: for tx call : setTxBuffer() and jtTransmitMessage()
+
+  // morse is clocked every ms while a message is sent, setTxEnabled() wakes the task otherwise
+  if (operatingMode == MODE_CW && (txEnabled || morseTxMsgSet))
+    return KEYER_TICK_US;
+  return TASK_POLL_US;
+}
+
+// Read and handle one WSJT-X packet
+// WSJTX message type: https://sourceforge.net/p/wsjt/wsjtx/ci/master/tree/Network/NetworkMessage.hpp#l141
+void wsjtxReceive()
+{
+  int packetSize = Udp.parsePacket();
+  if (packetSize)
   {
-    // logic for device mode WSJTX
-    // WSJTX message type: https://sourceforge.net/p/wsjt/wsjtx/ci/master/tree/Network/NetworkMessage.hpp#l141
+    unsigned long now = millis();
+    unsigned long receiveTime = micros();
 
-    int packetSize = Udp.parsePacket();
-    if (packetSize)
+    // receive incoming UDP packets
+    int len = Udp.read(WSJTX_incomingByteArray, 255);
+    if (len > 0)
     {
-      unsigned long now = millis();
+      WSJTX_currentIndex = 8; // skip packet header
 
-      // receive incoming UDP packets
-      int len = Udp.read(WSJTX_incomingByteArray, 255);
-      if (len > 0)
+      // Packet Type
+      uint32 WSJTX_packetType = readuInt32();
+      if (WSJTX_packetType == 1)
       {
-        WSJTX_currentIndex = 8; // skip packet header
-
-        // Packet Type
-        uint32 WSJTX_packetType = readuInt32();
-        if (WSJTX_packetType == 1)
+        //--------------------------------------------------------------------//
+        // Client id
+        int32 WSJTX_clientIdLength = readInt32();
+        char WSJTX_clientId[WSJTX_clientIdLength + 1];
+        for (int32 i = 0; i < WSJTX_clientIdLength; i++)
         {
-          //--------------------------------------------------------------------//
-          // Client id
-          int32 WSJTX_clientIdLength = readInt32();
-          char WSJTX_clientId[WSJTX_clientIdLength + 1];
-          for (int32 i = 0; i < WSJTX_clientIdLength; i++)
-          {
-            WSJTX_clientId[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_clientId[WSJTX_clientIdLength] = 0;
+          WSJTX_clientId[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_clientId[WSJTX_clientIdLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Dial Frequency
-          uint64 WSJTX_dialFrequency = readuInt64();
+        //--------------------------------------------------------------------//
+        // Dial Frequency
+        uint64 WSJTX_dialFrequency = readuInt64();
 
-          //--------------------------------------------------------------------//
-          // Mode
-          int32 WSJTX_modeLength = readInt32();
-          char WSJTX_mode[WSJTX_modeLength + 1];
-          for (int32 i = 0; i < WSJTX_modeLength; i++)
-          {
-            WSJTX_mode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_mode[WSJTX_modeLength] = 0;
+        //--------------------------------------------------------------------//
+        // Mode
+        int32 WSJTX_modeLength = readInt32();
+        char WSJTX_mode[WSJTX_modeLength + 1];
+        for (int32 i = 0; i < WSJTX_modeLength; i++)
+        {
+          WSJTX_mode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_mode[WSJTX_modeLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // DX Call
-          int32 WSJTX_dxCallLength = readInt32();
-          char WSJTX_dxCall[WSJTX_dxCallLength + 1];
-          for (int32 i = 0; i < WSJTX_dxCallLength; i++)
-          {
-            WSJTX_dxCall[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_dxCall[WSJTX_dxCallLength] = 0;
+        //--------------------------------------------------------------------//
+        // DX Call
+        int32 WSJTX_dxCallLength = readInt32();
+        char WSJTX_dxCall[WSJTX_dxCallLength + 1];
+        for (int32 i = 0; i < WSJTX_dxCallLength; i++)
+        {
+          WSJTX_dxCall[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_dxCall[WSJTX_dxCallLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Report
-          int32 WSJTX_reportLength = readInt32();
-          char WSJTX_report[WSJTX_reportLength + 1];
-          for (int32 i = 0; i < WSJTX_reportLength; i++)
-          {
-            WSJTX_report[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_report[WSJTX_reportLength] = 0;
+        //--------------------------------------------------------------------//
+        // Report
+        int32 WSJTX_reportLength = readInt32();
+        char WSJTX_report[WSJTX_reportLength + 1];
+        for (int32 i = 0; i < WSJTX_reportLength; i++)
+        {
+          WSJTX_report[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_report[WSJTX_reportLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Tx mode
-          int32 WSJTX_txModeLength = readInt32();
-          char WSJTX_txMode[WSJTX_txModeLength + 1];
-          for (int32 i = 0; i < WSJTX_txModeLength; i++)
-          {
-            WSJTX_txMode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_txMode[WSJTX_txModeLength] = 0;
+        //--------------------------------------------------------------------//
+        // Tx mode
+        int32 WSJTX_txModeLength = readInt32();
+        char WSJTX_txMode[WSJTX_txModeLength + 1];
+        for (int32 i = 0; i < WSJTX_txModeLength; i++)
+        {
+          WSJTX_txMode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_txMode[WSJTX_txModeLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Tx Enabled
-          bool WSJTX_txEnabled = readBool();
+        //--------------------------------------------------------------------//
+        // Tx Enabled
+        bool WSJTX_txEnabled = readBool();
 
-          //--------------------------------------------------------------------//
-          // Transmitting
-          bool WSJTX_transmitting = readBool();
+        //--------------------------------------------------------------------//
+        // Transmitting
+        bool WSJTX_transmitting = readBool();
 
-          //--------------------------------------------------------------------//
-          // Decoding
-          bool WSJTX_decoding = readBool();
+        //--------------------------------------------------------------------//
+        // Decoding
+        bool WSJTX_decoding = readBool();
 
-          //--------------------------------------------------------------------//
-          // Rx DF
-          uint32 WSJTX_rxDF = readuInt32();
+        //--------------------------------------------------------------------//
+        // Rx DF
+        uint32 WSJTX_rxDF = readuInt32();
 
-          //--------------------------------------------------------------------//
-          // Tx DF
-          uint32 WSJTX_txDF = readuInt32();
+        //--------------------------------------------------------------------//
+        // Tx DF
+        uint32 WSJTX_txDF = readuInt32();
 
-          //--------------------------------------------------------------------//
-          // DE call
-          int32 WSJTX_deCallLength = readInt32();
-          char WSJTX_deCall[WSJTX_deCallLength + 1];
-          for (int32 i = 0; i < WSJTX_deCallLength; i++)
-          {
-            WSJTX_deCall[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_deCall[WSJTX_deCallLength] = 0;
+        //--------------------------------------------------------------------//
+        // DE call
+        int32 WSJTX_deCallLength = readInt32();
+        char WSJTX_deCall[WSJTX_deCallLength + 1];
+        for (int32 i = 0; i < WSJTX_deCallLength; i++)
+        {
+          WSJTX_deCall[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_deCall[WSJTX_deCallLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // DE grid
-          int32 WSJTX_deGridLength = readInt32();
-          char WSJTX_deGrid[WSJTX_deGridLength + 1];
-          for (int32 i = 0; i < WSJTX_deGridLength; i++)
-          {
-            WSJTX_deGrid[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_deGrid[WSJTX_deGridLength] = 0;
+        //--------------------------------------------------------------------//
+        // DE grid
+        int32 WSJTX_deGridLength = readInt32();
+        char WSJTX_deGrid[WSJTX_deGridLength + 1];
+        for (int32 i = 0; i < WSJTX_deGridLength; i++)
+        {
+          WSJTX_deGrid[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_deGrid[WSJTX_deGridLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // DX grid
-          int32 WSJTX_dxGridLength = readInt32();
-          char WSJTX_dxGrid[WSJTX_dxGridLength + 1];
-          for (int32 i = 0; i < WSJTX_dxGridLength; i++)
-          {
-            WSJTX_dxGrid[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_dxGrid[WSJTX_dxGridLength] = 0;
+        //--------------------------------------------------------------------//
+        // DX grid
+        int32 WSJTX_dxGridLength = readInt32();
+        char WSJTX_dxGrid[WSJTX_dxGridLength + 1];
+        for (int32 i = 0; i < WSJTX_dxGridLength; i++)
+        {
+          WSJTX_dxGrid[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_dxGrid[WSJTX_dxGridLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Tx Watchdog
-          bool WSJTX_txWatchdog = readBool();
+        //--------------------------------------------------------------------//
+        // Tx Watchdog
+        bool WSJTX_txWatchdog = readBool();
 
-          //--------------------------------------------------------------------//
-          // Sub-mode
-          int32 WSJTX_subModeLength = readInt32();
-          char WSJTX_subMode[WSJTX_subModeLength + 1];
-          for (int32 i = 0; i < WSJTX_subModeLength; i++)
-          {
-            WSJTX_subMode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_subMode[WSJTX_subModeLength] = 0;
+        //--------------------------------------------------------------------//
+        // Sub-mode
+        int32 WSJTX_subModeLength = readInt32();
+        char WSJTX_subMode[WSJTX_subModeLength + 1];
+        for (int32 i = 0; i < WSJTX_subModeLength; i++)
+        {
+          WSJTX_subMode[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_subMode[WSJTX_subModeLength] = 0;
 
-          //--------------------------------------------------------------------//
-          // Fast mode
-          bool WSJTX_fastMode = readBool();
+        //--------------------------------------------------------------------//
+        // Fast mode
+        bool WSJTX_fastMode = readBool();
 
-          //--------------------------------------------------------------------//
-          // Special Operation Mode
-          uint8 WSJTX_specialOpMode = readuInt8();
+        //--------------------------------------------------------------------//
+        // Special Operation Mode
+        uint8 WSJTX_specialOpMode = readuInt8();
 
-          // Frequency Tolerance
-          uint32 WSJTX_frequencyTolerance = readuInt32();
+        // Frequency Tolerance
+        uint32 WSJTX_frequencyTolerance = readuInt32();
 
-          //--------------------------------------------------------------------//
-          // T/R Period
-          uint32 WSJTX_txrxPeriod = readuInt32();
+        //--------------------------------------------------------------------//
+        // T/R Period
+        uint32 WSJTX_txrxPeriod = readuInt32();
 
-          //--------------------------------------------------------------------//
-          // Configuration Name
-          int32 WSJTX_configNameLength = readInt32();
-          char WSJTX_configName[WSJTX_configNameLength + 1];
-          for (int32 i = 0; i < WSJTX_configNameLength; i++)
-          {
-            WSJTX_configName[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_configName[WSJTX_configNameLength] = 0;
-
-          //--------------------------------------------------------------------//
-          // Tx Message
-          int32 WSJTX_txMessageLength = readInt32();
-          // Funfact: While testing, I got WSJTX_txMessageLength=37 regardless of the actual message length.
-          // Therefore, WSJTX_txMessage needs to be trimmed.
-          char WSJTX_txMessage[WSJTX_txMessageLength + 1];
-          for (int32 i = 0; i < WSJTX_txMessageLength; i++)
-          {
-            WSJTX_txMessage[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
-            WSJTX_currentIndex += 1;
-          }
-          WSJTX_txMessage[WSJTX_txMessageLength] = 0;
+        //--------------------------------------------------------------------//
+        // Configuration Name
+        int32 WSJTX_configNameLength = readInt32();
+        char WSJTX_configName[WSJTX_configNameLength + 1];
+        for (int32 i = 0; i < WSJTX_configNameLength; i++)
+        {
+          WSJTX_configName[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_configName[WSJTX_configNameLength] = 0;
+
+        //--------------------------------------------------------------------//
+        // Tx Message
+        int32 WSJTX_txMessageLength = readInt32();
+        // Funfact: While testing, I got WSJTX_txMessageLength=37 regardless of the actual message length.
+        // Therefore, WSJTX_txMessage needs to be trimmed.
+        char WSJTX_txMessage[WSJTX_txMessageLength + 1];
+        for (int32 i = 0; i < WSJTX_txMessageLength; i++)
+        {
+          WSJTX_txMessage[i] = WSJTX_incomingByteArray[WSJTX_currentIndex];
+          WSJTX_currentIndex += 1;
+        }
+        WSJTX_txMessage[WSJTX_txMessageLength] = 0;
 
-          // set frequency
-          frequency = (WSJTX_dialFrequency + WSJTX_txDF) * 100ULL;
+        // set frequency
+        frequency = (WSJTX_dialFrequency + WSJTX_txDF) * 100ULL;
 
-          // trim tx message
-          String newTxMessage = String(WSJTX_txMessage);
-          newTxMessage.trim();
+        // trim tx message
+        char *newTxMessage = WSJTX_txMessage;
+        while (isspace((unsigned char)*newTxMessage))
+          newTxMessage++;
+        for (char *end = newTxMessage + strlen(newTxMessage); end > newTxMessage && isspace((unsigned char)end[-1]); end--)
+          end[-1] = 0;
 
-          if (strcmp(WSJTX_mode, "FT8") == 0)
-          {
-            symbolCount = FT8_SYMBOL_COUNT;
-            toneSpacing = FT8_TONE_SPACING;
-            toneDelay = FT8_DELAY;
-            operatingMode = MODE_FT8;
-            txEnabled = WSJTX_txEnabled;
-            strcpy(txMessage, newTxMessage.c_str());
-          }
-          else if (strcmp(WSJTX_mode, "FT4") == 0)
-          {
-            symbolCount = 105;
-            toneSpacing = 2083.3333; // ~20.83 Hz
-            toneDelay = 47;
-            operatingMode = MODE_FT4;
-            txEnabled = WSJTX_txEnabled;
-            strcpy(txMessage, newTxMessage.c_str());
-          }
-          else if (strcmp(WSJTX_mode, "WSPR") == 0)
+        int8_t mode = wsjtxFindMode(WSJTX_mode);
+        if (mode < 0)
+        {
+          txEnabled = false;
+        }
+        else
+        {
+          selectModeProfile(wsjtxModeProfile(static_cast<OperatingModes>(mode), WSJTX_subMode));
+          txEnabled = WSJTX_txEnabled;
+          if (modeDescriptors[mode].stationMessage)
           {
-            symbolCount = WSPR_SYMBOL_COUNT;
-            toneSpacing = WSPR_TONE_SPACING;
-            toneDelay = WSPR_DELAY;
-            operatingMode = MODE_WSPR;
-            txEnabled = WSJTX_txEnabled;
             strcpy(myCallsign, WSJTX_deCall);
             strcpy(myGridLocator, WSJTX_deGrid);
             // dbm value is not taken from WSJTX.
             // Enter correct dbm value from the web interface
           }
-          else if (strcmp(WSJTX_mode, "JT9") == 0)
-          {
-            symbolCount = JT9_SYMBOL_COUNT;
-            toneSpacing = JT9_TONE_SPACING;
-            toneDelay = JT9_DELAY;
-            operatingMode = MODE_JT9;
-            txEnabled = WSJTX_txEnabled;
-            strcpy(txMessage, newTxMessage.c_str());
-          }
-          else if (strcmp(WSJTX_mode, "JT65") == 0)
-          {
-            symbolCount = JT65_SYMBOL_COUNT;
-            toneSpacing = JT65_TONE_SPACING;
-            toneDelay = JT65_DELAY;
-            operatingMode = MODE_JT65;
-            txEnabled = WSJTX_txEnabled;
-            strcpy(txMessage, newTxMessage.c_str());
-          }
-          else if (strcmp(WSJTX_mode, "JT4") == 0)
-          {
-            symbolCount = JT4_SYMBOL_COUNT;
-            toneSpacing = JT4_TONE_SPACING;
-            toneDelay = JT4_DELAY;
-            operatingMode = MODE_JT4;
-            txEnabled = WSJTX_txEnabled;
-            strcpy(txMessage, newTxMessage.c_str());
-          }
           else
           {
-            txEnabled = false;
+            strlcpy(txMessage, newTxMessage, sizeof(txMessage));
           }
+        }
 
-          // update display
-          updateDisplay();
+        // have the tones ready before the slot, then start on the Transmitting edge
+        if (txEnabled)
+          wsjtxArm();
+        wsjtxTransmittingUpdate(WSJTX_transmitting, receiveTime);
+        wsjtxSlotUpdate();
 
-          // transmit Message
-          if (txEnabled && WSJTX_transmitting)
-          {
-            if (operatingMode == MODE_FT8)
-            {
-              ft8.encode(txMessage, txBuffer, false);
-            }
-            else if (operatingMode == MODE_FT4)
-            {
-              ft8.encode(txMessage, txBuffer, true);
-            }
-            else
-            {
-              setTxBuffer();
-            }
-            jtTransmitMessage();
-            txEnabled = false;
-          }
-        }
+        // update display
+        updateDisplay();
+      }
+    }
+  }
+}
+
+unsigned long wsjtxTask()
+{
+  if (deviceMode != WSJTX)
+    return TASK_POLL_US;
+
+  wsjtxSlotUpdate();
+  wsjtxReceive();
+
+  // one encode step per run, the keyer and the symbol deadlines get their turn in between
+  if (wsjtxArmStep())
+    return 0;
+
+  // a pending start is timed to the us
+  if (wsjtxStartPending)
+  {
+    long untilStart = (long)(wsjtxStartTime - micros());
+    if (untilStart <= 0)
+      return 0;
+    if ((unsigned long)untilStart < WSJTX_POLL_US)
+      return untilStart;
+  }
+  return WSJTX_POLL_US;
+}
+
+unsigned long toneTask()
+{
+  toneUdpUpdate();
+  return TONE_POLL_US;
+}
+
+unsigned long i2cTask()
+{
+  i2cService();
+  if (!i2cFramePending)
+    return TASK_SLEEP;
+
+  // held back by a symbol deadline: carry on once the symbol has been sent
+  unsigned long toDeadline = txTimeToDeadline();
+  return toDeadline < I2C_DEADLINE_GUARD_US ? toDeadline : 0;
+}
+
+unsigned long displayTask()
+{
+  if (!bootReady[BOOT_DISPLAY])
+    displayInit();
+  updateDisplay();
+  return TASK_SLEEP;
+}
+
+// Follow the WiFi connection: finish or fail the current attempt, retry after the pause and
+// start over when the connection drops
+unsigned long netTask()
+{
+  switch (netState)
+  {
+  case NET_IDLE:
+    return TASK_SLEEP;
+
+  case NET_CONNECTING:
+  {
+    wl_status_t status = WiFi.status();
+    if (status == WL_CONNECTED)
+    {
+      netConnected();
+      return NET_POLL_US;
+    }
+    if (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL ||
+        millis() - netAttemptStart >= WIFI_CONNECT_TIMEOUT_MS)
+      netFailed();
+    return NET_CONNECT_POLL_US;
+  }
+
+  case NET_CONNECTED:
+    if (WiFi.status() == WL_CONNECTED)
+      return NET_POLL_US;
+    Serial.printf("WiFi: connection lost\n");
+    strcpy(IP, "0.0.0.0");
+    taskWake(TASK_DISPLAY);
+    netConnect();
+    return NET_CONNECT_POLL_US;
+
+  case NET_RETRY_WAIT:
+    if ((long)(millis() - netRetryAt) < 0)
+      return (netRetryAt - millis()) * 1000UL;
+    netConnect();
+    return NET_CONNECT_POLL_US;
+  }
+  return TASK_SLEEP;
+}
+
+// Run the due tasks, highest priority (lowest TaskIds) first, then sleep until the next deadline.
+// A task is never run ahead of a due task of higher priority, so a symbol deadline waits for at
+// most one task run
+void schedulerRun()
+{
+  unsigned long passStart = micros();
+  while (micros() - passStart < SCHED_PASS_BUDGET_US)
+  {
+    unsigned long t = micros();
+    int8_t next = -1;
+    for (uint8_t i = 0; i < TASK_COUNT && next < 0; i++)
+    {
+      Task &task = tasks[i];
+      if (taskWoken[i])
+      {
+        taskWoken[i] = false;
+        if (task.sleeping || (long)(task.deadline - t) > 0)
+          task.deadline = t;
+        task.sleeping = false;
       }
+      if (!task.sleeping && (long)(t - task.deadline) >= 0)
+        next = i;
     }
+    if (next < 0)
+      break;
+
+    Task &task = tasks[next];
+    if (t - task.deadline > task.maxLateness)
+      task.maxLateness = t - task.deadline;
+
+    unsigned long allocs = heapCheckAllocs(next);
+    heapCheckBegin(next);
+    unsigned long wait = task.run();
+    heapCheckEnd(next, allocs);
+    unsigned long end = micros();
+    task.runs++;
+    if (end - t > task.maxRunTime)
+      task.maxRunTime = end - t;
+    task.sleeping = wait == TASK_SLEEP;
+    task.deadline = end + wait;
+  }
+
+  // Sleep until just before the nearest deadline
+  unsigned long t = micros();
+  unsigned long idle = SCHED_IDLE_MAX_US;
+  if (taskAnyWoken())
+    return;
+  for (uint8_t i = 0; i < TASK_COUNT; i++)
+  {
+    if (tasks[i].sleeping)
+      continue;
+    long remaining = (long)(tasks[i].deadline - t);
+    if (remaining < (long)SCHED_IDLE_MIN_US)
+      return;
+    if ((unsigned long)remaining < idle)
+      idle = remaining;
   }
+  // in slices, so a taskWake() from an ISR ends the sleep within SCHED_IDLE_SLICE_MS
+  while (micros() - t + SCHED_IDLE_SLICE_MS * 1000UL < idle && !taskAnyWoken())
+    delay(SCHED_IDLE_SLICE_MS);
+  schedIdleTime += micros() - t;
+}
+#pragma endregion Tasks
+
+// main loop
+void loop()
+{
+  schedulerRun();
 }
 
 // end of loop
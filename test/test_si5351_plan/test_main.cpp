@@ -0,0 +1,167 @@
+/*
+Host side check of the Si5351 tone planner, run with "pio test -e native".
+Every tone of a plan is rebuilt from its register images with si5351_model_output()
+and compared with the nominal frequency, on every band, for every digital mode
+and across a range of crystal calibrations.
+ */
+
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include "Si5351Regs.h"
+
+#define XTAL_FREQ (25000000UL)
+#define MAX_TONE_ERR (0.01) ///< Hz
+#define BAND_POINTS (20)    ///< Frequencies tried per band, edge to edge
+
+typedef struct
+{
+    const char *name;
+    uint32_t spacing_num; ///< Tone spacing in Hz is spacing_num / spacing_den
+    uint32_t spacing_den;
+    uint8_t max_tone;
+} plan_mode_t;
+
+static const plan_mode_t kModes[] = {
+    {"JT9", 12000, 6912, 8},
+    {"JT65", 11025, 4096, 65},
+    {"JT4", 11025, 2520, 3},
+    {"WSPR", 12000, 8192, 3},
+    {"FSQ", 36000, 4096, 32},
+    {"FT8", 12000, 1920, 7},
+    {"FT4", 12000, 576, 3},
+};
+
+static const int32_t kCorrections[] = {0, 12345, -54321, 150000, -150000};
+
+// Worst deviation of any tone of the plan from base_freq + k * spacing, in Hz
+static double plan_error(uint64_t ref_freq, uint64_t base_freq, const plan_mode_t *mode, const si5351_plan_t *plan)
+{
+    si5351_frac_t frac;
+    si5351_image_t ms, pll;
+    double worst = 0.0;
+
+    si5351_plan_ms(plan, &frac);
+    si5351_encode(&frac, &ms);
+    for (int tone = 0; tone <= mode->max_tone; ++tone)
+    {
+        si5351_plan_pll(plan, (uint8_t)tone, &frac);
+        si5351_encode(&frac, &pll);
+        double nominal = base_freq + 100.0 * tone * mode->spacing_num / mode->spacing_den;
+        double err = fabs(si5351_model_output(ref_freq, &pll, &ms) - nominal) / 100.0;
+        if (err > worst)
+            worst = err;
+    }
+    return worst;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_plan_error_every_band(void)
+{
+    char msg[96];
+
+    for (size_t cal = 0; cal < sizeof(kCorrections) / sizeof(kCorrections[0]); ++cal)
+    {
+        uint64_t ref_freq = si5351_corrected_ref(XTAL_FREQ, kCorrections[cal]);
+        for (int band = 0; band < SI5351_NUM_BANDS; ++band)
+        {
+            for (size_t m = 0; m < sizeof(kModes) / sizeof(kModes[0]); ++m)
+            {
+                const plan_mode_t *mode = &kModes[m];
+                uint64_t low = kSi5351_Bands[band].low * 100ULL;
+                uint64_t high = kSi5351_Bands[band].high * 100ULL;
+                uint64_t width = 100ULL * mode->spacing_num * mode->max_tone / mode->spacing_den + 100;
+
+                for (int i = 0; i <= BAND_POINTS; ++i)
+                {
+                    // Odd offsets keep the base off round numbers
+                    uint64_t base_freq = low + (high - width - low) * i / BAND_POINTS + 37 * i;
+                    si5351_plan_t plan;
+
+                    snprintf(msg, sizeof(msg), "%s at %llu.%02llu Hz, correction %ld", mode->name,
+                             (unsigned long long)(base_freq / 100), (unsigned long long)(base_freq % 100), (long)kCorrections[cal]);
+                    TEST_ASSERT_TRUE_MESSAGE(si5351_plan(ref_freq, base_freq, mode->spacing_num, mode->spacing_den, mode->max_tone, &plan), msg);
+                    TEST_ASSERT_TRUE_MESSAGE(plan_error(ref_freq, base_freq, mode, &plan) < MAX_TONE_ERR, msg);
+                    TEST_ASSERT_TRUE_MESSAGE(plan.max_err < MAX_TONE_ERR * 1e6, msg);
+                    TEST_ASSERT_TRUE_MESSAGE(!si5351_plan_ms_int(&plan) || (plan.ms_b == 0 && plan.ms_div % 2 == 0), msg);
+                }
+            }
+        }
+    }
+}
+
+void test_plan_raw_spacing(void)
+{
+    // Raw tone frames carry any spacing, including fractions whose terms overflow 16 bits
+    static const plan_mode_t kRaw[] = {
+        {"65537/8192", 65537, 8192, 255},
+        {"4294967295/1000000000", 4294967295UL, 1000000000UL, 63},
+        {"12000/13", 12000, 13, 40},
+        {"3/1", 3, 1, 255},
+    };
+    uint64_t ref_freq = si5351_corrected_ref(XTAL_FREQ, 0);
+    char msg[96];
+
+    for (size_t m = 0; m < sizeof(kRaw) / sizeof(kRaw[0]); ++m)
+    {
+        for (int band = 0; band < SI5351_NUM_BANDS; ++band)
+        {
+            uint64_t base_freq = kSi5351_Bands[band].low * 100ULL + 123456;
+            si5351_plan_t plan;
+
+            snprintf(msg, sizeof(msg), "spacing %s at %lu Hz", kRaw[m].name, (unsigned long)kSi5351_Bands[band].low);
+            TEST_ASSERT_TRUE_MESSAGE(si5351_plan(ref_freq, base_freq, kRaw[m].spacing_num, kRaw[m].spacing_den, kRaw[m].max_tone, &plan), msg);
+            TEST_ASSERT_TRUE_MESSAGE(plan_error(ref_freq, base_freq, &kRaw[m], &plan) < MAX_TONE_ERR, msg);
+        }
+    }
+}
+
+void test_plan_rejects_bad_spacing(void)
+{
+    uint64_t ref_freq = si5351_corrected_ref(XTAL_FREQ, 0);
+    si5351_plan_t plan;
+
+    TEST_ASSERT_FALSE(si5351_plan(ref_freq, 1407500000ULL, 0, 1, 7, &plan));
+    TEST_ASSERT_FALSE(si5351_plan(ref_freq, 1407500000ULL, 1, 0, 7, &plan));
+    // Finer than one feedback numerator step
+    TEST_ASSERT_FALSE(si5351_plan(ref_freq, 2800000000ULL, 1, 1000, 7, &plan));
+}
+
+void test_plan_ms_int_even_only(void)
+{
+    si5351_plan_t plan = {};
+
+    // Integer mode only for an even integer divider (AN619), anything else stays fractional
+    plan.ms_div = 36;
+    plan.ms_b = 0;
+    plan.ms_c = 1;
+    TEST_ASSERT_TRUE(si5351_plan_ms_int(&plan));
+    plan.ms_div = 35;
+    TEST_ASSERT_FALSE(si5351_plan_ms_int(&plan));
+    plan.ms_div = 36;
+    plan.ms_b = 1;
+    plan.ms_c = 3;
+    TEST_ASSERT_FALSE(si5351_plan_ms_int(&plan));
+    plan.ms_div = 35;
+    TEST_ASSERT_FALSE(si5351_plan_ms_int(&plan));
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    UNITY_BEGIN();
+    RUN_TEST(test_plan_error_every_band);
+    RUN_TEST(test_plan_raw_spacing);
+    RUN_TEST(test_plan_rejects_bad_spacing);
+    RUN_TEST(test_plan_ms_int_even_only);
+    return UNITY_END();
+}
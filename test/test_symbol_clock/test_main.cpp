@@ -0,0 +1,72 @@
+/*
+Host side check of the symbol deadlines, run with "pio test -e native".
+For every OperatingModes entry the deadline after n symbols must be exactly
+n times the symbol period (whole microseconds plus the carried remainder),
+the way txStart() and txAdvanceDeadline() step it over a transmission.
+ */
+
+#include <unity.h>
+#include <stdio.h>
+#include "ModeTiming.h"
+#include "SymbolClock.h"
+
+#define MAX_SYMBOLS (255) ///< Longest transmission, see TxChannel::tones
+
+// The deadline after n symbols, in 1 / den us, must equal n * period in the same unit
+static void check_drift(const char *name, Fraction period)
+{
+    symbol_clock_t clock;
+    char msg[64];
+
+    symbol_clock_init(&clock, period.num, period.den);
+    for (uint32_t n = 1; n <= MAX_SYMBOLS; ++n)
+    {
+        symbol_clock_advance(&clock);
+        uint64_t expected = 1000000ULL * period.num * n;
+        uint64_t actual = (uint64_t)clock.deadline * period.den + clock.deadline_rem;
+
+        snprintf(msg, sizeof(msg), "%s after %lu symbols", name, (unsigned long)n);
+        TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected, actual, msg);
+        TEST_ASSERT_TRUE_MESSAGE(clock.deadline_rem < period.den, msg);
+    }
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_no_drift_every_mode(void)
+{
+    char name[16];
+
+    for (uint8_t mode = 0; mode < MODE_COUNT; ++mode)
+    {
+        snprintf(name, sizeof(name), "mode %u", mode);
+        check_drift(name, modePeriods[mode]);
+    }
+}
+
+void test_no_drift_stream_periods(void)
+{
+    // Tone frames give the period in whole us over 1000000, profiles any fraction
+    check_drift("1 us", {1, 1000000});
+    check_drift("333333 us", {333333, 1000000});
+    check_drift("7 / 3 s", {7, 3});
+    check_drift("large denominator", {1, 4294967295UL});
+    check_drift("large remainder", {4294967294UL, 4294967295UL});
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    UNITY_BEGIN();
+    RUN_TEST(test_no_drift_every_mode);
+    RUN_TEST(test_no_drift_stream_periods);
+    return UNITY_END();
+}